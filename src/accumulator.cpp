@@ -0,0 +1,226 @@
+#include "accumulator.hpp"
+#include "engine.hpp"
+#include "log.hpp"
+#include "profiler.hpp"
+#include "shader_functions.hpp"
+#include "textured_quad.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <cmath>
+
+namespace {
+    const unsigned long unused_frames = 60; // before the target of a camera is dropped
+
+    float halton(int index, int base) {
+        float res = 0.f;
+        float f = 1.f;
+        while (index > 0) {
+            f /= base;
+            res += f * (index % base);
+            index /= base;
+        }
+        return res;
+    }
+
+    void drawQuad() {
+        glEnableVertexAttribArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, TexturedQuad::verticesBuffer());
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+    }
+}
+
+namespace { namespace ScaleShader {
+    // the output doesn't matter, the blending scales what is already in the target
+    GLuint program = 0;
+
+    const char* vert = R"VERT(#version 300 es
+precision mediump float;
+layout (location = 0) in vec3 Position;
+void main()
+{
+    gl_Position = vec4(Position.xyz, 1);
+})VERT";
+
+    const char* frag = R"FRAG(#version 300 es
+precision mediump float;
+layout (location = 0) out vec4 Out_Color;
+void main()
+{
+    Out_Color = vec4(0);
+})FRAG";
+
+    void init() {
+        if (program == 0) {
+            if (!create_program(program, vert, frag) or program == 0) {
+                Log::Error("Error creating program");
+                return;
+            }
+        }
+    }
+}}
+
+namespace { namespace ResolveShader {
+    GLuint program = 0;
+
+    const char* vert = R"VERT(#version 300 es
+precision mediump float;
+layout (location = 0) in vec3 Position;
+out vec2 uv;
+void main()
+{
+    uv = 0.5 * (Position.xy + vec2(1,1));
+    gl_Position = vec4(Position.xyz, 1);
+})VERT";
+
+    const char* frag = R"FRAG(#version 300 es
+precision mediump float;
+layout (location = 0) out vec4 Out_Color;
+in vec2 uv;
+uniform sampler2D accumulated;
+void main()
+{
+    Out_Color = texture(accumulated, uv);
+})FRAG";
+
+    GLuint AccumulatedID;
+
+    void init() {
+        if (program == 0) {
+            if (!create_program(program, vert, frag) or program == 0) {
+                Log::Error("Error creating program");
+                return;
+            }
+            AccumulatedID = glGetUniformLocation(program, "accumulated");
+        }
+    }
+}}
+
+Accumulator::Accumulator(int samples)
+    : m_samples(samples)
+{}
+
+Accumulator::~Accumulator() {
+    for (auto& [id, t] : m_targets)
+        release(t);
+}
+
+void Accumulator::release(Target& t) {
+    glDeleteFramebuffers(1, &t.frameBuffer);
+    glDeleteTextures(1, &t.texture);
+}
+
+bool Accumulator::resize(Target& t, int width, int height) {
+    if (t.texture == 0) {
+        glGenTextures(1, &t.texture);
+        glGenFramebuffers(1, &t.frameBuffer);
+    }
+    t.width = width;
+    t.height = height;
+    t.samples = 0;
+
+    // half floats so that the average of many samples doesn't band, renderable with EXT_color_buffer_float
+    glBindTexture(GL_TEXTURE_2D, t.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_HALF_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, t.frameBuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t.texture, 0);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    if (!complete) {
+        // 8 bits lose precision after a few samples, but still smooth the noise
+        Log::Warn("Float render targets not supported, accumulating in 8 bits");
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    }
+    return complete;
+}
+
+bool Accumulator::done(const Camera& cam) const {
+    auto it = m_targets.find(cam.id());
+    return it != m_targets.end()
+        and it->second.samples >= m_samples
+        and it->second.revision == cam.revision();
+}
+
+void Accumulator::render(const Camera& cam, size_t content, const Draw& draw) {
+    const auto& v = cam.viewport();
+    if (v.width <= 0 or v.height <= 0)
+        return;
+
+    GLint frameBuffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &frameBuffer);
+
+    const unsigned long frame = Engine::frame();
+    for (auto it = m_targets.begin(); it != m_targets.end();) {
+        if (it->second.used + unused_frames < frame) {
+            release(it->second);
+            it = m_targets.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    auto& t = m_targets[cam.id()];
+    t.used = frame;
+    if (t.width != v.width or t.height != v.height) {
+        if (!resize(t, v.width, v.height)) {
+            glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+            Log::Error("Can't create the accumulation target");
+            return;
+        }
+    }
+    // the first still frame restarts too, the samples drawn while moving may be of lower quality
+    if (t.revision != cam.revision() or t.content != content or t.moving) {
+        t.moving = t.revision != cam.revision();
+        t.revision = cam.revision();
+        t.content = content;
+        t.samples = 0;
+    }
+
+    if (t.samples < m_samples) {
+        PROFILE_SCOPE("accumulate");
+        glBindFramebuffer(GL_FRAMEBUFFER, t.frameBuffer);
+        glViewport(0, 0, t.width, t.height);
+        glEnable(GL_BLEND);
+
+        // running average, the target is scaled by n / (n + 1) and the sample added with a weight of 1 / (n + 1)
+        // rather than blended in one pass, so that pixels a sample doesn't cover fade too
+        const float weight = 1.f / (t.samples + 1);
+        ScaleShader::init();
+        glUseProgram(ScaleShader::program);
+        glBlendColor(0.f, 0.f, 0.f, 1.f - weight);
+        glBlendFunc(GL_ZERO, GL_CONSTANT_ALPHA);
+        drawQuad();
+
+        Sample s;
+        s.index = t.samples;
+        const glm::vec2 subpixel = s.index == 0 ? glm::vec2(0.f) : glm::vec2(halton(s.index, 2), halton(s.index, 3)) - 0.5f;
+        s.projection_view = glm::translate(glm::mat4(1.f), glm::vec3(2.f * subpixel / glm::vec2(t.width, t.height), 0.f))
+                            * cam.projection_view();
+        s.viewport = { 0, 0, t.width, t.height };
+        s.offset = std::fmod(s.index * 0.618034f, 1.f);
+        glBlendColor(0.f, 0.f, 0.f, weight);
+        glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE);
+        draw(s);
+        ++t.samples;
+        if (t.samples < m_samples)
+            Engine::request_frames();
+
+        glDisable(GL_BLEND);
+        glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+        glViewport(v.x, v.y, v.width, v.height);
+    }
+
+    // the samples are premultiplied by their coverage, so they go over what is already drawn
+    PROFILE_SCOPE("resolve");
+    ResolveShader::init();
+    glUseProgram(ResolveShader::program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, t.texture);
+    glUniform1i(ResolveShader::AccumulatedID, 0);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    drawQuad();
+    glDisable(GL_BLEND);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <glm/mat4x4.hpp>
+#include <functional>
+#include <unordered_map>
+
+#include <GLES3/gl3.h>
+#include "camera.hpp"
+
+// progressive refinement: averages jittered renders of a still view in a float target,
+// one per frame, and stops rendering once the target holds enough of them
+class Accumulator {
+public:
+    struct Sample {
+        glm::mat4 projection_view; // the camera's, moved by a subpixel offset
+        Viewport viewport;         // of the target, to draw into instead of the camera's
+        float offset;              // in [0, 1), to jitter the start of the rays
+        int index;
+    };
+    using Draw = std::function<void(const Sample&)>;
+
+    explicit Accumulator(int samples);
+    ~Accumulator();
+
+    Accumulator(const Accumulator&) = delete;
+    Accumulator& operator=(const Accumulator&) = delete;
+
+    // content is anything other than the camera that the image depends on, the accumulation restarts when it changes
+    // draws a new sample if needed, then composites the average over the camera's viewport
+    void render(const Camera& cam, size_t content, const Draw& draw);
+
+    bool done(const Camera& cam) const;
+
+    int samples() const { return m_samples; }
+    void set_samples(int samples) { m_samples = samples; }
+
+private:
+    struct Target {
+        unsigned long used = 0; // frame
+        unsigned long revision = 0;
+        size_t content = 0;
+        bool moving = false;
+        int samples = 0;
+        int width = 0;
+        int height = 0;
+        GLuint texture = 0;
+        GLuint frameBuffer = 0;
+    };
+    bool resize(Target& t, int width, int height);
+    static void release(Target& t);
+
+    int m_samples;
+    // by camera id, dropped once the camera hasn't rendered for a while
+    std::unordered_map<unsigned long, Target> m_targets;
+};
@@ -0,0 +1,13 @@
+#include "bytes.hpp"
+
+#include <sys/mman.h>
+
+Bytes Bytes::map(int fd, size_t size)
+{
+    if (size == 0)
+        return {};
+    auto data = (const unsigned char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return {};
+    return Bytes(data, size, [data, size] { munmap((void*)data, size); });
+}
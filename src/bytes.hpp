@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// immutable bytes shared without copies, whatever holds them: a mapped file, a fetch result, a vector...
+// the holder is released with the last copy, from whichever thread drops it
+class Bytes {
+public:
+    Bytes() = default;
+    // adopts memory, release frees it
+    Bytes(const unsigned char* data, size_t size, std::function<void()> release)
+        : m_data(data, [release = std::move(release)](const unsigned char*) { if (release) release(); })
+        , m_size(size)
+    {}
+    explicit Bytes(std::vector<unsigned char>&& v) {
+        auto owned = std::make_shared<const std::vector<unsigned char>>(std::move(v));
+        m_data = std::shared_ptr<const unsigned char>(owned, owned->data());
+        m_size = owned->size();
+    }
+    // maps the file, empty if it can't. the descriptor can be closed right after
+    static Bytes map(int fd, size_t size);
+
+    const unsigned char* data() const { return m_data.get(); }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const unsigned char* begin() const { return data(); }
+    const unsigned char* end() const { return data() + m_size; }
+
+private:
+    std::shared_ptr<const unsigned char> m_data;
+    size_t m_size = 0;
+};
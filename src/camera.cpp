@@ -1,5 +1,6 @@
 #include "camera.hpp"
 #include "cube.hpp"
+#include "engine.hpp"
 #include "imgui/imgui.h"
 #include "log.hpp"
 
@@ -7,6 +8,11 @@
 
 using namespace glm;
 
+Camera::Id::Id() {
+    static unsigned long s_id = 0;
+    value = ++s_id;
+}
+
 const mat4& Camera::projection_view() const {
     if (m_dirty) {
         mat4 view = mat4_cast(m_rot);
@@ -23,6 +29,11 @@ const mat4& Camera::projection_view() const {
 
         m_projection_view = proj * inverse(view);
         m_dirty = false;
+        // global so that two cameras never share a revision
+        static unsigned long s_revision = 0;
+        m_revision = ++s_revision;
+        // the views depending on this camera need a new frame, and it may keep moving while keys are held
+        Engine::request_frames();
     }
     return m_projection_view;
 }
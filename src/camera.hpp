@@ -18,12 +18,17 @@ struct Viewport {
 class Camera {
 public:
     const glm::mat4& projection_view() const;
+    // changes whenever projection_view() changes, to cache view-dependent data
+    unsigned long revision() const { projection_view(); return m_revision; }
+    // unlike its address, never reused by another camera, to key what is cached per camera. copies get their own
+    unsigned long id() const { return m_id.value; }
 
     void draw_widget();
 
     void handle_input(Input& i);
 
     void set_position(glm::vec3 pos) { m_pos = std::move(pos); m_dirty = true; }
+    void set_rotation(glm::quat rot) { m_rot = std::move(rot); m_dirty = true; }
     void set_viewport(Viewport v);
 
     void render(const Camera& cam) const;
@@ -33,6 +38,14 @@ public:
     const Viewport& viewport() const { return m_viewport; }
 
 private:
+    struct Id {
+        Id();
+        Id(const Id&) : Id() {}
+        Id& operator=(const Id&) { return *this; }
+        unsigned long value;
+    };
+    Id m_id;
+
     glm::vec3 m_pos = glm::vec3(0.0f);
     glm::quat m_rot = glm::quat(1,0,0,0);
 
@@ -53,6 +66,7 @@ private:
 
     mutable bool m_dirty = true;
     mutable glm::mat4 m_projection_view;
+    mutable unsigned long m_revision = 0;
 };
 
 struct ScreenPartition {
@@ -0,0 +1,211 @@
+#include "cpu_raymarcher.hpp"
+#include "glUtils.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    // rays are marched in packets, the compiler maps the vector types to sse or avx registers
+#if defined(__AVX__)
+    constexpr int lanes = 8;
+#else
+    constexpr int lanes = 4;
+#endif
+    typedef float floats __attribute__((vector_size(lanes * sizeof(float))));
+    typedef int ints __attribute__((vector_size(lanes * sizeof(int))));
+
+    // same as the shader
+    const float reference_step = 0.15f;
+    const float opaque = 0.95f;
+
+    const int tile_width = 8 * lanes;
+    const int tile_height = 8;
+
+    floats splat(float f) {
+        floats res;
+        for (int l = 0; l < lanes; ++l)
+            res[l] = f;
+        return res;
+    }
+
+    ints splat(int i) {
+        ints res;
+        for (int l = 0; l < lanes; ++l)
+            res[l] = i;
+        return res;
+    }
+
+    floats select(ints mask, floats a, floats b) { return (floats)((mask & (ints)a) | (~mask & (ints)b)); }
+    ints select(ints mask, ints a, ints b) { return (mask & a) | (~mask & b); }
+    floats clamp(floats v, floats lo, floats hi) { return select(v < lo, lo, select(v > hi, hi, v)); }
+    ints min(ints a, ints b) { return select(a < b, a, b); }
+    bool any(ints mask) {
+        for (int l = 0; l < lanes; ++l)
+            if (mask[l])
+                return true;
+        return false;
+    }
+
+    struct Context {
+        glm::mat4 mvp_inverse;
+        int width;
+        int height;
+        glm::ivec3 size;
+        int channels;
+        GLenum type;
+        glm::vec3 ratio;
+        float samples_per_voxel;
+        const unsigned char* data;
+        unsigned char* pixels;
+    };
+
+    // same as RayBoxShader: unprojects the pixel and clips its ray against the [-1, 1] cube
+    bool setupRay(const Context& ctx, int px, int py, glm::vec3& pos, glm::vec3& step, int& steps, float& opacity_exponent) {
+        glm::vec4 ndc(2.f * (px + 0.5f) / ctx.width - 1.f, 2.f * (py + 0.5f) / ctx.height - 1.f, -1.f, 1.f);
+        glm::vec4 near = ctx.mvp_inverse * ndc;
+        ndc.z = 1.f;
+        glm::vec4 far = ctx.mvp_inverse * ndc;
+        glm::vec3 origin = glm::vec3(near) / (near.w * ctx.ratio);
+        glm::vec3 dir = glm::vec3(far) / (far.w * ctx.ratio) - origin;
+
+        glm::vec3 t0 = (glm::vec3(-1.f) - origin) / dir;
+        glm::vec3 t1 = (glm::vec3(1.f) - origin) / dir;
+        glm::vec3 tmin = glm::min(t0, t1);
+        glm::vec3 tmax = glm::max(t0, t1);
+        float t_enter = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.f));
+        float t_exit = std::min(std::min(tmax.x, tmax.y), tmax.z);
+        if (!(t_enter < t_exit))
+            return false;
+
+        pos = 0.5f * (origin + t_enter * dir) + 0.5f;
+        glm::vec3 ray = 0.5f * (origin + t_exit * dir) + 0.5f - pos;
+        float samples = glm::length(ray * glm::vec3(ctx.size)) * ctx.samples_per_voxel;
+        step = ray / samples;
+        steps = (int)std::floor(samples);
+        opacity_exponent = glm::length(step) / reference_step;
+        return true;
+    }
+
+    // trilinear filtering with clamp to edge like the gpu, the channels are expanded to rgba like the shader does
+    void sample(const Context& ctx, const floats pos[3], ints active, floats out[4]) {
+        ints i0[3];
+        ints i1[3];
+        floats frac[3];
+        for (int a = 0; a < 3; ++a) {
+            floats u = clamp(pos[a] * splat((float)ctx.size[a]) - 0.5f, splat(0.f), splat((float)ctx.size[a] - 1.f));
+            i0[a] = __builtin_convertvector(u, ints); // u is positive, so this is floor
+            frac[a] = u - __builtin_convertvector(i0[a], floats);
+            i1[a] = min(i0[a] + 1, splat(ctx.size[a] - 1));
+        }
+
+        const int c = ctx.channels;
+        const bool half = ctx.type == GL_HALF_FLOAT;
+        floats corners[8][4] = {};
+        for (int l = 0; l < lanes; ++l) {
+            if (!active[l])
+                continue;
+            for (int corner = 0; corner < 8; ++corner) {
+                int x = (corner & 1 ? i1[0] : i0[0])[l];
+                int y = (corner & 2 ? i1[1] : i0[1])[l];
+                int z = (corner & 4 ? i1[2] : i0[2])[l];
+                const size_t voxel = (((size_t)z * ctx.size.y + y) * ctx.size.x + x) * c;
+                for (int ch = 0; ch < c; ++ch)
+                    corners[corner][ch][l] = half ? GlUtils::fromHalf(((const uint16_t*)ctx.data)[voxel + ch])
+                                                  : ctx.data[voxel + ch] * (1.f / 255.f);
+            }
+        }
+
+        floats val[4];
+        for (int ch = 0; ch < c; ++ch) {
+            auto lerp = [](floats a, floats b, floats t) { return a + (b - a) * t; };
+            floats x00 = lerp(corners[0][ch], corners[1][ch], frac[0]);
+            floats x10 = lerp(corners[2][ch], corners[3][ch], frac[0]);
+            floats x01 = lerp(corners[4][ch], corners[5][ch], frac[0]);
+            floats x11 = lerp(corners[6][ch], corners[7][ch], frac[0]);
+            val[ch] = lerp(lerp(x00, x10, frac[1]), lerp(x01, x11, frac[1]), frac[2]);
+        }
+        switch (c) {
+            case 1: out[0] = out[1] = out[2] = out[3] = val[0]; break;
+            case 2: out[0] = out[1] = out[2] = val[0]; out[3] = val[1]; break;
+            case 3: out[0] = val[0]; out[1] = val[1]; out[2] = val[2]; out[3] = splat(1.f); break;
+            default: out[0] = val[0]; out[1] = val[1]; out[2] = val[2]; out[3] = val[3]; break;
+        }
+    }
+
+    // marches a row of lanes pixels starting at (px, py), front to back like the shader
+    void renderPacket(const Context& ctx, int px, int py) {
+        floats pos[3] = {};
+        floats step[3] = {};
+        floats opacity_exponent = {};
+        ints steps = splat(0);
+        for (int l = 0; l < lanes and px + l < ctx.width; ++l) {
+            glm::vec3 p, s;
+            int n;
+            float e;
+            if (!setupRay(ctx, px + l, py, p, s, n, e))
+                continue;
+            opacity_exponent[l] = e;
+            for (int a = 0; a < 3; ++a) {
+                pos[a][l] = p[a];
+                step[a][l] = s[a];
+            }
+            steps[l] = n;
+        }
+
+        floats dst[4] = {};
+        ints i = splat(0);
+        ints active = i < steps;
+        while (any(active)) {
+            floats val[4];
+            sample(ctx, pos, active, val);
+            for (int l = 0; l < lanes; ++l)
+                val[3][l] = 1.f - std::pow(1.f - val[3][l], opacity_exponent[l]);
+            floats transparency = splat(1.f) - dst[3];
+            for (int ch = 0; ch < 3; ++ch)
+                dst[ch] = select(active, dst[ch] + transparency * val[ch] * val[3], dst[ch]);
+            dst[3] = select(active, dst[3] + transparency * val[3], dst[3]);
+
+            for (int a = 0; a < 3; ++a)
+                pos[a] += step[a];
+            i += 1;
+            active = active & (i < steps) & (dst[3] <= splat(opaque));
+        }
+
+        for (int l = 0; l < lanes and px + l < ctx.width; ++l) {
+            auto pixel = ctx.pixels + ((size_t)py * ctx.width + px + l) * 4;
+            for (int ch = 0; ch < 4; ++ch)
+                pixel[ch] = (unsigned char)(std::min(std::max(dst[ch][l], 0.f), 1.f) * 255.f + 0.5f);
+        }
+    }
+}
+
+CpuRaymarcher::CpuRaymarcher(const void* data, glm::ivec3 size, int c, GLenum type, glm::vec3 spacing)
+    : m_size(size)
+    , m_channels(c)
+    , m_type(type)
+    , m_ratio(glm::vec3(size) * spacing / glm::vec3(size.z * spacing.z))
+    , m_data((const unsigned char*)data, (const unsigned char*)data + (size_t)size.x * size.y * size.z * c * GlUtils::typeSize(type))
+{}
+
+void CpuRaymarcher::render(const glm::mat4& projection_view, int width, int height, std::vector<unsigned char>& pixels, float samples_per_voxel) const
+{
+    pixels.assign((size_t)width * height * 4, 0);
+    const Context ctx{ glm::inverse(projection_view), width, height, m_size, m_channels, m_type, m_ratio, samples_per_voxel, m_data.data(), pixels.data() };
+
+    const int tiles_x = (width + tile_width - 1) / tile_width;
+    const int tiles_y = (height + tile_height - 1) / tile_height;
+    ThreadPool::global().parallel_for(tiles_x * tiles_y, [&](int tile) {
+        int x0 = (tile % tiles_x) * tile_width;
+        int y0 = (tile / tiles_x) * tile_height;
+        for (int y = y0; y < std::min(height, y0 + tile_height); ++y)
+            for (int x = x0; x < std::min(width, x0 + tile_width); x += lanes)
+                renderPacket(ctx, x, y);
+    });
+}
+
+void CpuRaymarcher::render(const Camera& cam, std::vector<unsigned char>& pixels, float samples_per_voxel) const
+{
+    const auto& v = cam.viewport();
+    render(cam.projection_view(), v.width, v.height, pixels, samples_per_voxel);
+}
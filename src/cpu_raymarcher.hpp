@@ -0,0 +1,34 @@
+#pragma once
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <vector>
+
+#include <GLES3/gl3.h>
+#include "camera.hpp"
+
+// reference implementation of Volume's raymarching, for rendering without a gpu
+class CpuRaymarcher {
+public:
+    // laid out like the data given to Volume, and of the same types: GL_UNSIGNED_BYTE or GL_HALF_FLOAT
+    CpuRaymarcher(const void* data, glm::ivec3 size, int c,
+                  GLenum type = GL_UNSIGNED_BYTE,
+                  glm::vec3 spacing = glm::vec3(1.f));
+
+    // rgba pixels, bottom row first like glReadPixels, samples_per_voxel is Volume's quality
+    void render(const glm::mat4& projection_view, int width, int height, std::vector<unsigned char>& pixels,
+                float samples_per_voxel = 1.f) const;
+    void render(const Camera& cam, std::vector<unsigned char>& pixels, float samples_per_voxel = 1.f) const;
+
+    const glm::ivec3& size() const { return m_size; }
+    int channels() const { return m_channels; }
+    GLenum type() const { return m_type; }
+    const glm::vec3& ratio() const { return m_ratio; }
+
+private:
+    glm::ivec3 m_size;
+    int m_channels;
+    GLenum m_type;
+    glm::vec3 m_ratio;
+    std::vector<unsigned char> m_data; // raw bits for half floats
+};
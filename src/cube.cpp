@@ -9,6 +9,7 @@ namespace Buffers {
     bool ok = false;
     GLuint verticesBuffer;
     int verticesCount;
+    GLuint frameBuffer;
 
     void init() {
         if (ok)
@@ -57,6 +58,7 @@ namespace Buffers {
         glBindBuffer(GL_ARRAY_BUFFER, verticesBuffer);
         glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(float), &verts[0], GL_STATIC_DRAW);
 
+        glGenFramebuffers(1, &frameBuffer);
         ok = true;
     }
 }}
@@ -65,6 +67,16 @@ Cube::Cube() {
     Buffers::init();
 }
 
+GLuint Cube::verticesBuffer() {
+    Buffers::init();
+    return Buffers::verticesBuffer;
+}
+
+int Cube::verticesCount() {
+    Buffers::init();
+    return Buffers::verticesCount;
+}
+
 namespace { namespace RgbShader {
     GLuint program = 0;
 
@@ -139,13 +151,24 @@ void Cube::render(const glm::mat4& mvp) const
 
 void Cube::renderToTexture(const Camera& cam, const glm::vec3& ratio, bool front, TexturedQuad& quad) const
 {
-    GLuint fb;
-    glGenFramebuffers(1, &fb);
-    glBindFramebuffer(GL_FRAMEBUFFER, fb);
-
+    // may be called while rendering to another target, see Accumulator
+    GLint frameBuffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &frameBuffer);
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLfloat clear_color[4];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, Buffers::frameBuffer);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, quad.texture(), 0);
+    glDisable(GL_BLEND);
+
+    // the texture may be reused, so clear what was there before
+    glViewport(0, 0, quad.width(), quad.height());
+    glClearColor(0.f, 0.f, 0.f, 0.f);
+    glClear(GL_COLOR_BUFFER_BIT);
 
-    //glViewport(0, 0, quad.width(), quad.height());
     glEnable(GL_CULL_FACE);
     if (front)
         glCullFace(GL_BACK);
@@ -154,7 +177,9 @@ void Cube::renderToTexture(const Camera& cam, const glm::vec3& ratio, bool front
     render(cam, ratio);
     glDisable(GL_CULL_FACE);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDeleteFramebuffers(1, &fb);
+    glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+    if (blend)
+        glEnable(GL_BLEND);
 }
-
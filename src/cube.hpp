@@ -17,4 +17,7 @@ public:
                          const glm::vec3& ratio,
                          bool front,
                          TexturedQuad& quad) const;
+
+    static GLuint verticesBuffer();
+    static int verticesCount();
 };
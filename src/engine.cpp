@@ -1,6 +1,7 @@
 #include "engine.hpp"
 #include "input.hpp"
 #include "log.hpp"
+#include "profiler.hpp"
 #include "scancodes.hpp"
 
 #include "imgui/imgui.h"
@@ -10,6 +11,8 @@
 #include <emscripten/html5.h>
 #include <GLES3/gl3.h>
 
+#include <atomic>
+
 namespace Engine {
 namespace {
     ImGuiIO* m_io;
@@ -24,7 +27,12 @@ namespace {
     std::array<float,4> m_clear_color = {0.2f, 0.4f, 0.6f, 1.f};
     double m_last_time;
     double m_elapsed_time = 1/60.f;
+    unsigned long m_frame = 0;
     bool m_visible = true;
+    bool m_on_demand = true;
+    std::atomic<int> m_requested_frames{1};
+    // imgui needs a few frames to settle after an event, for hovering and focus changes
+    const int input_frames = 3;
 
     Input m_prev_input;
     Input m_input;
@@ -34,6 +42,7 @@ namespace {
 
     EM_BOOL focusInOutCallback(int eventType, const EmscriptenFocusEvent *focusEvent, void *userData)
     {
+        request_frames(input_frames);
         for (int i = 0; i < 512; ++i)
             m_input.keyDown[i] = m_io->KeysDown[i] = false;
         for (int i = 0; i < 5; ++i)
@@ -48,6 +57,7 @@ namespace {
     }
 
     EM_BOOL canvasSizeCallback(int eventType, const void* reserved, void* userData) {
+        request_frames(input_frames);
         emscripten_get_canvas_element_size("#canvas", &m_width, &m_height);
         m_input.width = m_width;
         m_input.height = m_height;
@@ -57,6 +67,7 @@ namespace {
     }
 
     EM_BOOL keyUpDownCallback(int eventType, const EmscriptenKeyboardEvent *keyEvent, void *userData) {
+        request_frames(input_frames);
         if (keyEvent->keyCode >= sizeof(ScanCode::keyCodeToScanCode))
             return false;
         int scancode = ScanCode::keyCodeToScanCode[keyEvent->keyCode];
@@ -83,6 +94,7 @@ namespace {
     }
 
     EM_BOOL keyPressCallback(int eventType, const EmscriptenKeyboardEvent *keyEvent, void *userData) {
+        request_frames(input_frames);
         char text[5];
         unsigned long codepoint = keyEvent->charCode;
         if (codepoint <= 0x7F) {
@@ -110,6 +122,7 @@ namespace {
     }
 
     EM_BOOL touchMoveCallback(int eventType, const EmscriptenTouchEvent *touchEvent, void *userData) {
+        request_frames(input_frames);
         if (touchEvent->numTouches == 0)
             return true;
         m_input.mousePos = { touchEvent->touches[0].canvasX, touchEvent->touches[0].canvasY };
@@ -117,6 +130,7 @@ namespace {
         return true;
     }
     EM_BOOL touchStartEndCallback(int eventType, const EmscriptenTouchEvent *touchEvent, void *userData) {
+        request_frames(input_frames);
         if (touchEvent->numTouches == 0)
             return true;
         if (m_openHovered and eventType != EMSCRIPTEN_EVENT_TOUCHSTART) {
@@ -135,11 +149,13 @@ namespace {
 
 
     EM_BOOL mouseMoveCallback(int eventType, const EmscriptenMouseEvent *mouseEvent, void *userData) {
+        request_frames(input_frames);
         m_input.mousePos = { mouseEvent->canvasX, mouseEvent->canvasY };
         m_io->MousePos = { (float)m_input.mousePos.x, (float)m_input.mousePos.y };
         return true;
     }
     EM_BOOL mouseClickCallback(int eventType, const EmscriptenMouseEvent *mouseEvent, void *userData) {
+        request_frames(input_frames);
         if (m_openHovered and mouseEvent->button == 0 and eventType == EMSCRIPTEN_EVENT_MOUSEDOWN) {
             Log::Info("Opening file...");
             emscripten_run_script("document.getElementById('fileElem').click();");
@@ -158,6 +174,7 @@ namespace {
         return true;
     }
     EM_BOOL mouseWheelCallback(int eventType, const EmscriptenWheelEvent *mouseEvent, void *userData) {
+        request_frames(input_frames);
         if (mouseEvent->deltaY < 0) { m_io->MouseWheel += 1; m_input.mouseWheel++; }
         if (mouseEvent->deltaY > 0) { m_io->MouseWheel -= 1; m_input.mouseWheel--; }
         if (mouseEvent->deltaX < 0) { m_io->MouseWheelH += 1; }
@@ -186,12 +203,21 @@ namespace {
             return;
         }
         double current_time = emscripten_get_now() / 1000;
+        // nothing changed, what was drawn last stays on screen
+        int requested = m_requested_frames.load();
+        while (requested > 0 and not m_requested_frames.compare_exchange_weak(requested, requested - 1));
+        if (m_on_demand and requested == 0) {
+            m_last_time = current_time;
+            return;
+        }
         m_elapsed_time = current_time - m_last_time;
         m_io->DeltaTime = m_elapsed_time;
         m_input.setChangedFlags(m_prev_input);
         m_input.mouseCaptured = m_io->WantCaptureMouse; 
         m_input.keyboardCaptured = m_io->WantCaptureKeyboard;
 
+        ++m_frame;
+        Profiler::begin_frame();
         if (m_show_gui) {
             ImGui_ImplOpenGL3_NewFrame();
             ImGui::NewFrame();
@@ -204,12 +230,17 @@ namespace {
         glClearColor(m_clear_color[0], m_clear_color[1], m_clear_color[2], m_clear_color[3]);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        m_loop_func();
+        {
+            PROFILE_SCOPE("loop");
+            m_loop_func();
+        }
 
         if (m_show_gui) {
+            PROFILE_SCOPE("imgui");
             ImGui::Render();
             ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
         }
+        Profiler::end_frame();
         if (m_released_touch)
         {
             m_io->MousePos = { -FLT_MAX, -FLT_MAX };
@@ -345,6 +376,15 @@ bool& quit() {
     return m_quit;
 }
 
+bool& on_demand() {
+    return m_on_demand;
+}
+
+void request_frames(int count) {
+    int requested = m_requested_frames.load();
+    while (requested < count and not m_requested_frames.compare_exchange_weak(requested, count));
+}
+
 std::array<float,4>& clear_color() {
     return m_clear_color;
 }
@@ -357,6 +397,10 @@ double elapsed_time(){
     return m_elapsed_time;
 }
 
+unsigned long frame() {
+    return m_frame;
+}
+
 Input& input(){
     return m_input;
 }
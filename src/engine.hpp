@@ -12,9 +12,15 @@ namespace Engine {
 
     bool& show_gui();
     bool& quit();
+    // only draw the frames something asked for, instead of redrawing at the display's refresh rate
+    bool& on_demand();
+    // at least the next count frames will be drawn, for changes and animations, callable from any thread
+    void request_frames(int count = 1);
     std::array<float,4>& clear_color();
     bool visible();
     double elapsed_time();
+    // of the frame being drawn, for the caches to drop what wasn't used lately
+    unsigned long frame();
 
     Input& input();
 
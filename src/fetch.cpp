@@ -2,61 +2,62 @@
 
 //#include <esmcripten/fetch.h>
 
-/*void fetchImageSuccess(emscripten_fetch_t *fetch)
+/*// the fetch is closed once the decoder and current_image_data are done with its data
+Bytes fetched(emscripten_fetch_t *fetch)
+{
+    return Bytes(reinterpret_cast<const unsigned char*>(fetch->data), fetch->numBytes, [fetch] { emscripten_fetch_close(fetch); });
+}
+
+void fetchImageSuccess(emscripten_fetch_t *fetch)
 {
-    auto c = on_scope_end([&]{ emscripten_fetch_close(fetch); });
     if (fetch->numBytes == 0) {
         Log::Error("expected data, but received none");
+        emscripten_fetch_close(fetch);
         return;
     }
-    Log::Info("trying to load received data (" + std::to_string(fetch->numBytes/1000) + "kb) as image");
-    if (loadImageToQuad(reinterpret_cast<const unsigned char*>(fetch->data), fetch->numBytes)) {
-        current_image_data.resize(fetch->numBytes);
-        std::memcpy(current_image_data.data(), fetch->data, current_image_data.size());
-    }
+    Log::Info(FMT("trying to load received data ({}kb) as image"), fetch->numBytes / 1000);
+    loadImage(fetched(fetch));
 }
 
 void getProcessingResultSuccess(emscripten_fetch_t *fetch)
 {
-    auto c = on_scope_end([&]{ emscripten_fetch_close(fetch); });
     if (fetch->numBytes == 0) {
         Log::Error("expected data, but received none");
+        emscripten_fetch_close(fetch);
         return;
     }
-    Log::Info("trying to load received data (" + std::to_string(fetch->numBytes/1000) + "kb) as image");
-    if (loadImageToQuad(reinterpret_cast<const unsigned char*>(fetch->data), fetch->numBytes)) {
-        current_image_data.resize(fetch->numBytes);
-        std::memcpy(current_image_data.data(), fetch->data, current_image_data.size());
+    Log::Info(FMT("trying to load received data ({}kb) as image"), fetch->numBytes / 1000);
+    if (loadImage(fetched(fetch)))
         resetLabels();
-    }
 }
 
 void genericSuccess(emscripten_fetch_t *fetch)
 {
     Log::Info("api call succeeded");
+    delete static_cast<Bytes*>(fetch->userData);
     emscripten_fetch_close(fetch);
 }
 
 void genericFail(emscripten_fetch_t *fetch)
 {
     Log::Error("api call failed");
+    delete static_cast<Bytes*>(fetch->userData);
     emscripten_fetch_close(fetch);
 }
 
-void sendSerializedImage(const char* apiPath, const std::vector<unsigned char>& png_data)
+void sendSerializedImage(const char* apiPath, Bytes data)
 {
-    Log::Info("sending image to "s + apiPath);
+    Log::Info(FMT("sending image to {}"), apiPath);
     emscripten_fetch_attr_t attr;
     emscripten_fetch_attr_init(&attr);
     strcpy(attr.requestMethod, "POST");
     attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
     attr.onsuccess = genericSuccess;
     attr.onerror = genericFail;
-    int n = png_data.size();
-    auto tmp = new char[n];
-    std::memcpy(tmp, png_data.data(), n);
-    attr.requestDataSize = n;
-    attr.requestData = tmp;
+    // sent from where it is, and kept until the request is done
+    attr.requestDataSize = data.size();
+    attr.requestData = reinterpret_cast<const char*>(data.data());
+    attr.userData = new Bytes(std::move(data));
     auto s = "api/"s + apiPath;
     emscripten_fetch(&attr, s.c_str());
 }
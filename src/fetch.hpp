@@ -1,6 +1,6 @@
 #pragma once
 
-#include <vector>
+#include "bytes.hpp"
 
 //struct emscripten_fetch_t;
 
@@ -10,7 +10,7 @@ namespace Fetch {
     void getProcessingResultSuccess(emscripten_fetch_t *fetch);
     void genericSuccess(emscripten_fetch_t *fetch);
     void genericFail(emscripten_fetch_t *fetch);
-    void sendSerializedImage(const char* apiPath, const std::vector<unsigned char>& png_data);
+    void sendSerializedImage(const char* apiPath, Bytes data);
     void getProcessingResult();
     void fetchRandomImage();
 }
@@ -1,4 +1,80 @@
 #pragma once
 
+#include <GLES3/gl3.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// EXT_texture_norm16, in case the headers don't have it
+#ifndef GL_R16_EXT
+#define GL_R16_EXT 0x822A
+#define GL_RG16_EXT 0x822C
+#define GL_RGB16_EXT 0x8054
+#define GL_RGBA16_EXT 0x805B
+#endif
+
 namespace GlUtils {
+    // of textures and pixels with this many channels, 0 if there is none
+    inline GLenum format(int channels) {
+        switch (channels) {
+            case 1: return GL_RED;
+            case 2: return GL_RG;
+            case 3: return GL_RGB;
+            case 4: return GL_RGBA;
+            default: return 0;
+        }
+    }
+
+    // 16 bits normalized textures, filterable, with EXT_texture_norm16. where it is missing 16 bits data is stored
+    // as half floats, the only other filterable 16 bits format of webgl2, which keep 11 bits of it. needs the context
+    inline bool norm16() {
+        static const bool supported = [] {
+            auto extensions = (const char*)glGetString(GL_EXTENSIONS);
+            return extensions and std::strstr(extensions, "texture_norm16");
+        }();
+        return supported;
+    }
+
+    // type is GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT if norm16(), or GL_HALF_FLOAT
+    inline GLenum internalFormat(int channels, GLenum type) {
+        static const GLenum bytes[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+        static const GLenum shorts[] = { GL_R16_EXT, GL_RG16_EXT, GL_RGB16_EXT, GL_RGBA16_EXT };
+        static const GLenum halfs[] = { GL_R16F, GL_RG16F, GL_RGB16F, GL_RGBA16F };
+        if (channels < 1 or channels > 4)
+            return 0;
+        return (type == GL_HALF_FLOAT ? halfs : type == GL_UNSIGNED_SHORT ? shorts : bytes)[channels - 1];
+    }
+
+    inline int typeSize(GLenum type) {
+        return type == GL_UNSIGNED_BYTE ? 1 : 2;
+    }
+
+    inline uint16_t toHalf(float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        uint32_t sign = (bits >> 16) & 0x8000;
+        int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+        uint32_t mantissa = bits & 0x7fffff;
+        if (exponent <= 0) // too small for a normal half, flush to zero
+            return sign;
+        if (exponent >= 31)
+            return sign | 0x7c00;
+        // rounding may carry into the exponent, which is what we want
+        return sign | ((exponent << 10) + ((mantissa + 0x1000) >> 13));
+    }
+
+    inline float fromHalf(uint16_t h) {
+        const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+        const uint32_t exponent = (h >> 10) & 0x1f;
+        const uint32_t mantissa = h & 0x3ff;
+        if (exponent == 0) { // zero or subnormal
+            const float f = std::ldexp((float)mantissa, -24);
+            return sign ? -f : f;
+        }
+        const uint32_t bits = exponent == 31 ? sign | 0x7f800000 | (mantissa << 13)
+                                             : sign | ((exponent + 112) << 23) | (mantissa << 13);
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
 }
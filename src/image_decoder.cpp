@@ -0,0 +1,208 @@
+#include "image_decoder.hpp"
+#include "engine.hpp"
+#include "glUtils.hpp"
+#include "log.hpp"
+#include "thread_pool.hpp"
+
+#include "stb/stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <limits>
+#include <mutex>
+
+namespace {
+    const int placeholder_size = 64; // longest side
+    const int preview_size = 1024;   // same
+#ifdef __EMSCRIPTEN__
+    // the wasm32 heap grows to 2GB at most, other images and volumes included
+    const size_t max_decode_bytes = size_t(1) << 30;
+#else
+    const size_t max_decode_bytes = size_t(16) << 30;
+#endif
+
+    // at the peak of a decode: the file, the pixels, and as much again for stb's buffers while it decodes,
+    // more than the third of the pixels the coarser levels of a pyramid take after
+    size_t decodeBytes(size_t encoded, int width, int height, int channels, bool wide) {
+        return encoded + 2 * (size_t)width * height * channels * (wide ? 2 : 1);
+    }
+
+    // stb refuses pngs of more than 1GB of pixels from their header, without telling their size
+    bool pngSize(const Bytes& encoded, int& width, int& height) {
+        static const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        const unsigned char* p = encoded.data();
+        if (encoded.size() < 24 or std::memcmp(p, signature, sizeof(signature)) != 0 or std::memcmp(p + 12, "IHDR", 4) != 0)
+            return false;
+        auto be32 = [&](int i) { return (uint32_t)p[i] << 24 | p[i + 1] << 16 | p[i + 2] << 8 | p[i + 3]; };
+        width = std::min<uint32_t>(be32(16), 1 << 30);
+        height = std::min<uint32_t>(be32(20), 1 << 30);
+        return true;
+    }
+
+    ImageDecoder::Image scaled(const ImageDecoder::Image& image, int size, ImageDecoder::Stage stage) {
+        ImageDecoder::Image res;
+        res.stage = stage;
+        res.channels = image.channels;
+        res.type = image.type;
+        const float scale = std::min(1.f, (float)size / std::max(image.width, image.height));
+        res.width = std::max(1, (int)(image.width * scale));
+        res.height = std::max(1, (int)(image.height * scale));
+        const int c = res.channels * GlUtils::typeSize(res.type); // bytes per texel
+        auto pixels = std::shared_ptr<unsigned char>(new unsigned char[res.width * res.height * c], std::default_delete<unsigned char[]>());
+        if (!image.pixels) {
+            std::fill_n(pixels.get(), res.width * res.height * c, 128);
+        } else {
+            // nearest, it's only shown for a moment
+            for (int y = 0; y < res.height; ++y) {
+                const unsigned char* row = image.pixels.get() + (size_t)(y * image.height / res.height) * image.width * c;
+                for (int x = 0; x < res.width; ++x)
+                    std::copy_n(row + (size_t)(x * image.width / res.width) * c, c, pixels.get() + (y * res.width + x) * c);
+            }
+        }
+        res.pixels = std::move(pixels);
+        return res;
+    }
+}
+
+struct ImageDecoder::Job {
+    Bytes encoded;
+    std::atomic<bool> cancelled{false};
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::optional<Image> latest; // a stage the main loop didn't pick up yet is replaced by the next one
+    bool finished = false;
+
+    void post(Image image) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (cancelled)
+                return;
+            finished = image.stage == Done or image.stage == Failed;
+            latest = std::move(image);
+        }
+        cond.notify_all();
+        Engine::request_frames();
+    }
+};
+
+ImageDecoder::~ImageDecoder() {
+    cancel();
+}
+
+bool ImageDecoder::start(Bytes encoded, int max_size)
+{
+    cancel();
+    // stb takes the length of the file as an int
+    if (encoded.size() > (size_t)std::numeric_limits<int>::max()) {
+        Log::Error(FMT("The file is too large: {}MB, stb decodes files of 2GB at most"), encoded.size() >> 20);
+        return false;
+    }
+    Image header;
+    if (!stbi_info_from_memory(encoded.data(), encoded.size(), &header.width, &header.height, &header.channels)) {
+        int width, height;
+        if (pngSize(encoded, width, height) and (size_t)width * height > (size_t(1) << 30) / 4)
+            Log::Error(FMT("The image is too large: {}x{} pixels, stb decodes pngs of 1GB at most"), width, height);
+        else
+            Log::Error("failed to load image");
+        return false;
+    }
+    // the whole image is decoded in memory, tiled or not
+    const bool wide = stbi_is_16_bit_from_memory(encoded.data(), encoded.size());
+    if (decodeBytes(encoded.size(), header.width, header.height, header.channels, wide) > max_decode_bytes) {
+        Log::Error(FMT("The image is too large: {}x{} pixels, {} channels of {} bits would take more than the {}MB it can be decoded in"),
+                   header.width, header.height, header.channels, wide ? 16 : 8, max_decode_bytes >> 20);
+        return false;
+    }
+    header.channels = 1;
+    m_job = std::make_shared<Job>();
+    m_job->encoded = std::move(encoded);
+    m_job->post(scaled(header, placeholder_size, Placeholder));
+    ThreadPool::global().submit([job = m_job, max_size, norm16 = GlUtils::norm16()] { run(job, max_size, norm16); });
+    return true;
+}
+
+void ImageDecoder::run(const std::shared_ptr<Job>& job, int max_size, bool norm16)
+{
+    // stb can't be interrupted, a cancelled decode stops at the next stage
+    if (job->cancelled)
+        return;
+    // in the file's channels and depth, forcing 4 channels would take up to 4 times the memory
+    Image image;
+    const auto data = job->encoded.data();
+    const size_t size = job->encoded.size(); // fits in an int, see start()
+    const bool wide = stbi_is_16_bit_from_memory(data, (int)size);
+    auto mem = wide ? (void*)stbi_load_16_from_memory(data, (int)size, &image.width, &image.height, &image.channels, 0)
+                    : (void*)stbi_load_from_memory(data, (int)size, &image.width, &image.height, &image.channels, 0);
+    if (!mem) {
+        Log::Error("failed to load image");
+        job->post({});
+        return;
+    }
+    image.pixels = std::shared_ptr<const unsigned char>((unsigned char*)mem, stbi_image_free);
+    if (job->cancelled)
+        return;
+    if (wide and norm16) {
+        image.type = GL_UNSIGNED_SHORT;
+    } else if (wide) {
+        // in place, halfs are as large. they keep 11 bits of the 16
+        image.type = GL_HALF_FLOAT;
+        auto values = (uint16_t*)mem;
+        const size_t row = (size_t)image.width * image.channels;
+        ThreadPool::global().parallel_for(image.height, [&](int y) {
+            for (size_t i = y * row; i < (y + 1) * row; ++i)
+                values[i] = GlUtils::toHalf(values[i] / 65535.f);
+        });
+    }
+
+    if (std::max(image.width, image.height) > max_size) {
+        job->post(scaled(image, preview_size, Preview));
+        image.tiles = std::make_unique<TilePyramid>(image.pixels, image.width, image.height, image.channels, image.type);
+        if (job->cancelled)
+            return;
+    }
+    image.stage = Done;
+    image.encoded = job->encoded;
+    job->post(std::move(image));
+}
+
+void ImageDecoder::cancel()
+{
+    if (!m_job)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_job->mutex);
+        m_job->cancelled = true;
+        m_job->latest.reset();
+    }
+    m_job.reset();
+}
+
+bool ImageDecoder::busy() const {
+    return m_job != nullptr;
+}
+
+std::optional<ImageDecoder::Image> ImageDecoder::poll()
+{
+    if (!m_job)
+        return std::nullopt;
+    std::optional<Image> image;
+    bool finished;
+    {
+        std::lock_guard<std::mutex> lock(m_job->mutex);
+        image.swap(m_job->latest);
+        finished = m_job->finished;
+    }
+    if (finished)
+        m_job.reset();
+    return image;
+}
+
+void ImageDecoder::wait()
+{
+    if (!m_job)
+        return;
+    std::unique_lock<std::mutex> lock(m_job->mutex);
+    m_job->cond.wait(lock, [&] { return m_job->finished; });
+}
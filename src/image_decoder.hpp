@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+
+#include "bytes.hpp"
+#include "tile_pyramid.hpp"
+
+// decodes images on the thread pool, for the main loop to pick them up without waiting.
+// a decode shows up in stages: a placeholder of the right size right away, then for images that
+// have to be tiled a smaller preview while the pyramid is built, and finally the image
+class ImageDecoder {
+public:
+    enum Stage { Placeholder, Preview, Done, Failed };
+
+    struct Image {
+        Stage stage = Failed;
+        int width = 0;
+        int height = 0;
+        int channels = 0;                            // as in the file, greyscale images have 1 or 2
+        GLenum type = GL_UNSIGNED_BYTE;              // 16 bits images GL_UNSIGNED_SHORT, or GL_HALF_FLOAT without norm16
+        std::shared_ptr<const unsigned char> pixels; // rows from the bottom, shared with the tiles if tiled
+        std::unique_ptr<TilePyramid> tiles;          // for images larger than the max_size given to start()
+        Bytes encoded;                               // the file, given back when done
+    };
+
+    ImageDecoder() = default;
+    ~ImageDecoder(); // cancels
+
+    ImageDecoder(const ImageDecoder&) = delete;
+    ImageDecoder& operator=(const ImageDecoder&) = delete;
+
+    // cancels the decode in progress, if any, and starts decoding this one. false if it isn't an image, or if it
+    // is too large to decode in memory: about 13000x13000 rgb pixels of 8 bits in the browser, tiled or not
+    // max_size is TexturedQuad::max_untiled_size(), which needs the main thread, as does GlUtils::norm16()
+    bool start(Bytes encoded, int max_size);
+    void cancel();
+    bool busy() const;
+
+    // the latest stage reached since the last call
+    std::optional<Image> poll();
+    // until the decode is done, for the native build to render the image from the first frame
+    void wait();
+
+private:
+    struct Job;
+    static void run(const std::shared_ptr<Job>& job, int max_size, bool norm16);
+
+    std::shared_ptr<Job> m_job;
+};
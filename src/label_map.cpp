@@ -0,0 +1,535 @@
+#include "label_map.hpp"
+#include "engine.hpp"
+#include "glUtils.hpp"
+#include "profiler.hpp"
+#include "thread_pool.hpp"
+
+#include <glm/geometric.hpp>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+
+namespace {
+    const size_t max_dirty_rects = 16; // more are merged into one
+    const int history_tile = 64;
+    const size_t history_budget = 32 << 20; // bytes of compressed tiles, in the undo and redo steps
+
+    void putVarint(std::vector<unsigned char>& out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back((unsigned char)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((unsigned char)v);
+    }
+
+    // the end of the run of row[begin] within [begin, end), compared 8 bytes at a time
+    int runEnd(const unsigned char* row, int begin, int end) {
+        const unsigned char value = row[begin];
+        const uint64_t repeated = 0x0101010101010101ull * value;
+        int x = begin + 1;
+        for (uint64_t word; x + 8 <= end; x += 8) {
+            std::memcpy(&word, row + x, 8);
+            if (word != repeated)
+                break;
+        }
+        while (x < end and row[x] == value)
+            ++x;
+        return x;
+    }
+
+    // of the colour channels, 0 to 255
+    template <GLenum type, int colours>
+    float intensity(const unsigned char* texel) {
+        float sum = 0.f;
+        for (int c = 0; c < colours; ++c)
+            sum += type == GL_HALF_FLOAT ? GlUtils::fromHalf(((const uint16_t*)texel)[c]) * 255.f
+                 : type == GL_UNSIGNED_SHORT ? ((const uint16_t*)texel)[c] * (255.f / 65535.f)
+                 : texel[c];
+        return sum * (1.f / colours);
+    }
+
+    // 1 in mask for the texels within tolerance of reference, at the given offsets of a row of the image
+    template <GLenum type, int colours>
+    void threshold(const unsigned char* row, const std::vector<size_t>& columns, float reference, float tolerance, unsigned char* mask) {
+        for (size_t i = 0; i < columns.size(); ++i)
+            mask[i] = std::abs(intensity<type, colours>(row + columns[i]) - reference) <= tolerance;
+    }
+
+    // the mean of the colours, without alpha
+    template <GLenum type>
+    auto intensityOf(bool grey) { return grey ? intensity<type, 1> : intensity<type, 3>; }
+
+    template <GLenum type>
+    auto thresholdOf(bool grey) { return grey ? threshold<type, 1> : threshold<type, 3>; }
+}
+struct LabelMap::Fill {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done = false;
+    unsigned char label;
+    std::vector<Span> spans;
+};
+
+LabelMap::LabelMap(int w, int h)
+    : m_width(w)
+    , m_height(h)
+    , m_pixels((size_t)w * h, 0)
+    , m_rows(h)
+    , m_quad(new TexturedQuad(m_pixels.data(), w, h, 1, true))
+    , m_tiles_x((w + history_tile - 1) / history_tile)
+    , m_saved(m_tiles_x * ((h + history_tile - 1) / history_tile), 0)
+{}
+
+LabelMap::~LabelMap()
+{
+    // it reads the labels
+    if (m_fill)
+        fillDone(true);
+}
+
+void LabelMap::paint(glm::vec2 from, glm::vec2 to, int label, float radius, float blob_ratio)
+{
+    finishFill();
+    // the texture draws the same stroke with the next ones, nothing is uploaded
+    m_quad->paint(from, to, label, radius, blob_ratio);
+    // the capsule of PaintShader, tested at the centre of the texels. it is convex, so each row is covered
+    // from its first texel inside to its last
+    blob_ratio /= (float)m_width / m_height;
+    from *= glm::vec2{ blob_ratio * m_width, m_height };
+    to *= glm::vec2{ blob_ratio * m_width, m_height };
+    const glm::vec2 ab = from - to;
+    const float length = glm::dot(ab, ab);
+    const float inverse_length = length > 0.f ? 1.f / length : 0.f;
+    const int x0 = std::max(0, (int)std::floor((std::min(from.x, to.x) - radius) / blob_ratio - 0.5f));
+    const int x1 = std::min(m_width - 1, (int)std::ceil((std::max(from.x, to.x) + radius) / blob_ratio));
+    const int y0 = std::max(0, (int)std::floor(std::min(from.y, to.y) - radius - 0.5f));
+    const int y1 = std::min(m_height - 1, (int)std::ceil(std::max(from.y, to.y) + radius));
+    if (x0 > x1 or y0 > y1)
+        return;
+
+    std::vector<unsigned char> covered(x1 - x0 + 1);
+    for (int y = y0; y <= y1; ++y) {
+        // without branches, for the compiler to vectorize it
+        const float py = y + 0.5f - to.y;
+        for (int i = 0; i <= x1 - x0; ++i) {
+            const float px = (x0 + i + 0.5f) * blob_ratio - to.x;
+            const float t = std::min(std::max((px * ab.x + py * ab.y) * inverse_length, 0.f), 1.f);
+            const float dx = px - t * ab.x;
+            const float dy = py - t * ab.y;
+            covered[i] = dx * dx + dy * dy <= radius * radius;
+        }
+        const auto first = std::find(covered.begin(), covered.end(), 1);
+        if (first == covered.end())
+            continue;
+        const int left = x0 + (first - covered.begin());
+        const int right = x0 + (covered.rend() - std::find(covered.rbegin(), covered.rend(), 1)); // excluded
+        save(y, left, right);
+        std::fill(m_pixels.begin() + (size_t)y * m_width + left, m_pixels.begin() + (size_t)y * m_width + right, label);
+        fill(y, left, right, label);
+    }
+}
+
+void LabelMap::clear()
+{
+    finishFill();
+    endStep();
+    for (int tile = 0; tile < (int)m_saved.size(); ++tile) {
+        const Rect r = tileRect(tile);
+        save(r.y0, r.x0, r.x1);
+    }
+    std::fill(m_pixels.begin(), m_pixels.end(), 0);
+    for (auto& row : m_rows)
+        row.clear();
+    m_runs = 0;
+    dirty({ 0, 0, m_width, m_height });
+    endStep();
+    Engine::request_frames();
+}
+
+void LabelMap::floodFill(glm::vec2 seed, int label)
+{
+    startFill(seed, label, [pixels = m_pixels.data(), w = m_width, h = m_height, label](int x, int y, std::vector<Span>& spans) {
+        const unsigned char value = pixels[(size_t)y * w + x];
+        if (value == label)
+            return;
+        scanline(w, h, x, y, [&](int j, unsigned char* mask) {
+            const unsigned char* row = pixels + (size_t)j * w;
+            for (int i = 0; i < w; ++i)
+                mask[i] = row[i] == value;
+        }, spans);
+    });
+}
+
+void LabelMap::grow(glm::vec2 seed, int label, const Image& image, int tolerance)
+{
+    if (!image.pixels)
+        return;
+    startFill(seed, label, [image, tolerance, w = m_width, h = m_height](int x, int y, std::vector<Span>& spans) {
+        // the texel of the image at the centre of each texel of the labels, they needn't be the same size
+        const int texel = image.channels * GlUtils::typeSize(image.type);
+        std::vector<size_t> columns(w);
+        for (int i = 0; i < w; ++i)
+            columns[i] = (size_t)std::min(image.width - 1, (int)((i + 0.5f) * image.width / w)) * texel;
+        auto row = [&](int j) {
+            return image.pixels.get() + (size_t)std::min(image.height - 1, (int)((j + 0.5f) * image.height / h)) * image.width * texel;
+        };
+        const bool grey = image.channels < 3;
+        auto measure = image.type == GL_HALF_FLOAT ? intensityOf<GL_HALF_FLOAT>(grey)
+                     : image.type == GL_UNSIGNED_SHORT ? intensityOf<GL_UNSIGNED_SHORT>(grey)
+                     : intensityOf<GL_UNSIGNED_BYTE>(grey);
+        auto test = image.type == GL_HALF_FLOAT ? thresholdOf<GL_HALF_FLOAT>(grey)
+                  : image.type == GL_UNSIGNED_SHORT ? thresholdOf<GL_UNSIGNED_SHORT>(grey)
+                  : thresholdOf<GL_UNSIGNED_BYTE>(grey);
+        const float reference = measure(row(y) + columns[x]);
+        // labels finer than the image sample its rows more than once, the mask of the last one tested is kept aside
+        // as the fill clears the texels it fills from it
+        const unsigned char* last_row = nullptr;
+        std::vector<unsigned char> last_mask(w);
+        scanline(w, h, x, y, [&](int j, unsigned char* mask) {
+            if (row(j) != last_row) {
+                last_row = row(j);
+                test(last_row, columns, reference, tolerance, last_mask.data());
+            }
+            std::memcpy(mask, last_mask.data(), w);
+        }, spans);
+    });
+}
+
+void LabelMap::startFill(glm::vec2 seed, int label, std::function<void(int x, int y, std::vector<Span>& spans)> find)
+{
+    finishFill();
+    const int x = (int)std::floor(seed.x * m_width);
+    const int y = (int)std::floor(seed.y * m_height);
+    if (x < 0 or y < 0 or x >= m_width or y >= m_height)
+        return;
+    m_fill = std::make_shared<Fill>();
+    m_fill->label = label;
+    ThreadPool::global().submit([fill = m_fill, x, y, find = std::move(find)] {
+        std::vector<Span> spans;
+        find(x, y, spans);
+        {
+            std::lock_guard<std::mutex> lock(fill->mutex);
+            fill->spans = std::move(spans);
+            fill->done = true;
+        }
+        fill->cond.notify_all();
+        Engine::request_frames();
+    });
+}
+
+bool LabelMap::fillDone(bool wait) const
+{
+    std::unique_lock<std::mutex> lock(m_fill->mutex);
+    if (wait)
+        m_fill->cond.wait(lock, [&] { return m_fill->done; });
+    return m_fill->done;
+}
+
+void LabelMap::poll()
+{
+    if (m_fill and fillDone(false))
+        applyFill();
+}
+
+void LabelMap::finishFill()
+{
+    if (!m_fill)
+        return;
+    fillDone(true);
+    applyFill();
+}
+
+void LabelMap::applyFill()
+{
+    PROFILE_SCOPE("fill labels");
+    const auto done = std::move(m_fill); // leaves it empty
+    // a step of its own
+    endStep();
+    Rect painted = { m_width, m_height, 0, 0 };
+    for (const Span& span : done->spans) {
+        save(span.y, span.begin, span.end);
+        std::fill_n(m_pixels.begin() + (size_t)span.y * m_width + span.begin, span.end - span.begin, done->label);
+        fill(span.y, span.begin, span.end, done->label);
+        painted = { std::min(painted.x0, span.begin), std::min(painted.y0, span.y),
+                    std::max(painted.x1, span.end), std::max(painted.y1, span.y + 1) };
+    }
+    if (painted.x0 < painted.x1) {
+        dirty(painted);
+        Engine::request_frames();
+    }
+    endStep();
+}
+
+// the rows are tested as a whole when first reached, then filled a span at a time from a seed, each span seeding the
+// rows above and below once for each of their runs that is inside. the runs are found 8 texels at a time
+template <class Inside>
+void LabelMap::scanline(int w, int h, int x, int y, Inside inside, std::vector<Span>& spans)
+{
+    // 1 where inside and not filled yet, left uninitialized until tested
+    std::unique_ptr<unsigned char[]> mask(new unsigned char[(size_t)w * h]);
+    std::vector<bool> tested(h, false);
+    auto row = [&](int j) {
+        unsigned char* res = mask.get() + (size_t)j * w;
+        if (!tested[j]) {
+            inside(j, res);
+            tested[j] = true;
+        }
+        return res;
+    };
+    std::vector<std::pair<int, int>> seeds = { { x, y } };
+    while (!seeds.empty()) {
+        const auto [sx, sy] = seeds.back();
+        seeds.pop_back();
+        unsigned char* current = row(sy);
+        if (!current[sx])
+            continue;
+        int begin = sx;
+        while (begin > 0 and current[begin - 1])
+            --begin;
+        const int end = runEnd(current, sx, w);
+        std::memset(current + begin, 0, end - begin);
+        spans.push_back({ sy, begin, end });
+        for (const int ny : { sy - 1, sy + 1 }) {
+            if (ny < 0 or ny >= h)
+                continue;
+            const unsigned char* next = row(ny);
+            for (int i = begin; i < end; i = runEnd(next, i, end))
+                if (next[i])
+                    seeds.push_back({ i, ny });
+        }
+    }
+}
+
+LabelMap::Rect LabelMap::tileRect(int tile) const
+{
+    const int x = tile % m_tiles_x * history_tile;
+    const int y = tile / m_tiles_x * history_tile;
+    return { x, y, std::min(x + history_tile, m_width), std::min(y + history_tile, m_height) };
+}
+
+// runs of a byte, as a LEB128 count followed by the byte
+LabelMap::Snapshot LabelMap::snapshot(int tile) const
+{
+    Snapshot res{ tile, {} };
+    const Rect r = tileRect(tile);
+    int count = 0;
+    unsigned char value = m_pixels[(size_t)r.y0 * m_width + r.x0];
+    for (int y = r.y0; y < r.y1; ++y) {
+        const unsigned char* row = m_pixels.data() + (size_t)y * m_width;
+        for (int x = r.x0; x < r.x1;) {
+            if (row[x] != value) {
+                putVarint(res.compressed, count);
+                res.compressed.push_back(value);
+                count = 0;
+                value = row[x];
+            }
+            const int end = runEnd(row, x, r.x1);
+            count += end - x;
+            x = end;
+        }
+    }
+    putVarint(res.compressed, count);
+    res.compressed.push_back(value);
+    res.compressed.shrink_to_fit();
+    return res;
+}
+
+void LabelMap::save(int y, int begin, int end)
+{
+    if (m_open.tiles.empty()) {
+        // a new branch of the history
+        for (const Step& step : m_redo)
+            m_history_bytes -= step.bytes;
+        m_redo.clear();
+    }
+    const int ty = y / history_tile;
+    for (int tx = begin / history_tile; tx <= (end - 1) / history_tile; ++tx) {
+        const int tile = ty * m_tiles_x + tx;
+        if (m_saved[tile] == m_step)
+            continue;
+        m_saved[tile] = m_step;
+        m_open.tiles.push_back(snapshot(tile));
+        m_open.bytes += m_open.tiles.back().compressed.size();
+    }
+}
+
+void LabelMap::endStep()
+{
+    if (m_open.tiles.empty())
+        return;
+    m_history_bytes += m_open.bytes;
+    m_undo.push_back(std::move(m_open));
+    m_open = {};
+    ++m_step;
+    while (m_history_bytes > history_budget and m_undo.size() > 1) {
+        m_history_bytes -= m_undo.front().bytes;
+        m_undo.pop_front();
+    }
+}
+
+void LabelMap::swap(Step& step)
+{
+    Step replaced;
+    // of each row, the columns restored, for its runs to be rebuilt once rather than tile by tile
+    std::vector<std::pair<int, int>> restored(m_height, { INT_MAX, INT_MIN });
+    for (const Snapshot& saved : step.tiles) {
+        replaced.tiles.push_back(snapshot(saved.tile));
+        replaced.bytes += replaced.tiles.back().compressed.size();
+
+        const Rect r = tileRect(saved.tile);
+        const unsigned char* in = saved.compressed.data();
+        int x = r.x0, y = r.y0;
+        while (y < r.y1) {
+            int count = 0;
+            for (int shift = 0;; shift += 7) {
+                count |= (*in & 0x7f) << shift;
+                if (!(*in++ & 0x80))
+                    break;
+            }
+            const unsigned char value = *in++;
+            // a run may go on over the next rows of the tile
+            while (count) {
+                const int n = std::min(count, r.x1 - x);
+                std::memset(m_pixels.data() + (size_t)y * m_width + x, value, n);
+                count -= n;
+                x += n;
+                if (x == r.x1) {
+                    x = r.x0;
+                    ++y;
+                }
+            }
+        }
+        for (int i = r.y0; i < r.y1; ++i)
+            restored[i] = { std::min(restored[i].first, r.x0), std::max(restored[i].second, r.x1) };
+        dirty(r);
+    }
+    for (int y = 0; y < m_height; ++y) {
+        const auto [begin, end] = restored[y];
+        if (begin >= end)
+            continue;
+        const unsigned char* row = m_pixels.data() + (size_t)y * m_width;
+        fill(y, begin, end, 0);
+        for (int x = begin; x < end;) {
+            const int run_end = runEnd(row, x, end);
+            if (row[x])
+                fill(y, x, run_end, row[x]);
+            x = run_end;
+        }
+    }
+    m_history_bytes += replaced.bytes;
+    m_history_bytes -= step.bytes;
+    step = std::move(replaced);
+    Engine::request_frames();
+}
+
+bool LabelMap::undo()
+{
+    finishFill();
+    endStep();
+    if (m_undo.empty())
+        return false;
+    Step step = std::move(m_undo.back());
+    m_undo.pop_back();
+    swap(step);
+    m_redo.push_back(std::move(step));
+    return true;
+}
+
+bool LabelMap::redo()
+{
+    finishFill();
+    endStep();
+    if (m_redo.empty())
+        return false;
+    Step step = std::move(m_redo.back());
+    m_redo.pop_back();
+    swap(step);
+    m_undo.push_back(std::move(step));
+    return true;
+}
+
+void LabelMap::dirty(Rect rect)
+{
+    // merged with the ones it overlaps or touches, few enough to be uploaded one by one
+    auto touches = [&](const Rect& r) { return r.x0 <= rect.x1 and rect.x0 <= r.x1 and r.y0 <= rect.y1 and rect.y0 <= r.y1; };
+    auto merge = [](Rect a, const Rect& b) { return Rect{ std::min(a.x0, b.x0), std::min(a.y0, b.y0), std::max(a.x1, b.x1), std::max(a.y1, b.y1) }; };
+    for (auto it = std::find_if(m_dirty.begin(), m_dirty.end(), touches); it != m_dirty.end();
+         it = std::find_if(m_dirty.begin(), m_dirty.end(), touches)) {
+        rect = merge(rect, *it);
+        m_dirty.erase(it);
+    }
+    m_dirty.push_back(rect);
+    if (m_dirty.size() > max_dirty_rects) {
+        for (size_t i = 1; i < m_dirty.size(); ++i)
+            m_dirty[0] = merge(m_dirty[0], m_dirty[i]);
+        m_dirty.resize(1);
+    }
+}
+
+const TexturedQuad& LabelMap::quad() const
+{
+    for (const Rect& r : m_dirty)
+        m_quad->update(r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0, m_pixels.data() + (size_t)r.y0 * m_width + r.x0, m_width);
+    m_dirty.clear();
+    return *m_quad;
+}
+
+void LabelMap::fill(int y, int begin, int end, unsigned char label)
+{
+    auto& row = m_rows[y];
+    const auto first = std::partition_point(row.begin(), row.end(), [&](const Run& r) { return r.end <= begin; });
+    const auto last = std::partition_point(first, row.end(), [&](const Run& r) { return r.begin < end; });
+    // what is left of the runs it overlaps, around the new one
+    Run pieces[3];
+    int count = 0;
+    if (first != last and first->begin < begin)
+        pieces[count++] = { first->begin, begin, first->label };
+    if (label)
+        pieces[count++] = { begin, end, label };
+    if (first != last and std::prev(last)->end > end)
+        pieces[count++] = { end, std::prev(last)->end, std::prev(last)->label };
+
+    const size_t index = first - row.begin();
+    m_runs -= last - first;
+    row.insert(row.erase(first, last), pieces, pieces + count);
+    m_runs += count;
+    // merged with the neighbours of the same label that touch them
+    size_t i = index > 0 ? index - 1 : 0;
+    const size_t stop = std::min(row.size(), index + count + 1);
+    for (size_t j = i + 1; j < stop; ++j) {
+        if (row[i].end == row[j].begin and row[i].label == row[j].label) {
+            row[i].end = row[j].end;
+            --m_runs;
+        } else {
+            row[++i] = row[j];
+        }
+    }
+    row.erase(row.begin() + std::min(i + 1, row.size()), row.begin() + stop);
+}
+
+std::vector<unsigned char> LabelMap::serialize() const
+{
+    std::vector<unsigned char> res;
+    putVarint(res, width());
+    putVarint(res, height());
+    int previous = -1;
+    for (int y = 0; y < (int)m_rows.size(); ++y) {
+        const auto& row = m_rows[y];
+        if (row.empty())
+            continue;
+        putVarint(res, y - previous);
+        putVarint(res, row.size());
+        int x = 0;
+        for (const Run& run : row) {
+            putVarint(res, run.begin - x);
+            putVarint(res, run.end - run.begin);
+            res.push_back(run.label);
+            x = run.end;
+        }
+        previous = y;
+    }
+    return res;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <glm/vec2.hpp>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "textured_quad.hpp"
+
+// the labels painted over an image, 0 being unlabelled. they are painted on the cpu, where they are kept both as a
+// label per texel and as the runs of labelled texels of each row, so that exporting them costs nothing or what was
+// painted rather than the size of the map. the texture they are drawn from paints the same strokes on the gpu, in a
+// batch, and only gets the rectangles the fills, undo and redo changed since it was last used.
+// painting can be undone: the tiles a step changes are kept before it, compressed, within a memory budget
+class LabelMap {
+public:
+    // the image under the labels, for the fills that follow it. see ImageDecoder::Image
+    struct Image {
+        std::shared_ptr<const unsigned char> pixels; // rows from the bottom
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        GLenum type = GL_UNSIGNED_BYTE;
+    };
+
+    LabelMap(int w, int h);
+    ~LabelMap(); // waits for the fill in progress
+
+    // the same capsule as TexturedQuad::paint
+    void paint(glm::vec2 from, glm::vec2 to, int label, float radius, float blob_ratio);
+    // unlabels everything, as a step that can be undone
+    void clear();
+
+    // fill the texels connected to seed (in [0, 1] texture coordinates) with label, as a step that can be undone.
+    // they are found on the thread pool, then painted by poll() or before anything else changes the labels
+    // floodFill: those of the seed's label
+    void floodFill(glm::vec2 seed, int label);
+    // grow: those whose intensity in the image is within tolerance (out of 255) of the seed's, whatever their label
+    void grow(glm::vec2 seed, int label, const Image& image, int tolerance);
+    // paints the fill found since the last call, if any. from the main loop
+    void poll();
+    bool filling() const { return m_fill != nullptr; }
+
+    // the paint() calls since the last step are one step, e.g. when the button is released
+    void endStep();
+    // false if there is nothing to undo or redo
+    bool undo();
+    bool redo();
+    bool canUndo() const { return !m_undo.empty() or !m_open.tiles.empty(); }
+    bool canRedo() const { return !m_redo.empty(); }
+    size_t historySize() const { return m_history_bytes; } // in bytes
+
+    // with the painted rectangles uploaded
+    const TexturedQuad& quad() const;
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    size_t runs() const { return m_runs; }
+
+    // the label of each texel, rows from the bottom like the texture
+    const std::vector<unsigned char>& pixels() const { return m_pixels; }
+    // width and height, then for each row with labels: its distance to the previous one (the first to -1), its
+    // number of runs, and for each run the distance from the end of the previous one (or 0), its length and its label
+    // as a byte. the rest are LEB128 varints
+    std::vector<unsigned char> serialize() const;
+
+private:
+    struct Run {
+        int begin;
+        int end;
+        unsigned char label;
+    };
+    struct Rect {
+        int x0, y0, x1, y1; // x1 and y1 excluded
+    };
+    struct Snapshot {
+        int tile;
+        std::vector<unsigned char> compressed;
+    };
+    struct Step {
+        std::vector<Snapshot> tiles;
+        size_t bytes = 0;
+    };
+    struct Span {
+        int y, begin, end; // end excluded
+    };
+    struct Fill;
+
+    // [begin, end) of row y, label 0 erases
+    void fill(int y, int begin, int end, unsigned char label);
+    void dirty(Rect rect);
+    // before [begin, end) of row y is changed by the open step
+    void save(int y, int begin, int end);
+    Rect tileRect(int tile) const;
+    Snapshot snapshot(int tile) const;
+    // swaps the tiles of the step with the labels, the step then holds what was replaced
+    void swap(Step& step);
+
+    // find is given the texel of the seed, on a worker, while the labels don't change
+    void startFill(glm::vec2 seed, int label, std::function<void(int x, int y, std::vector<Span>& spans)> find);
+    bool fillDone(bool wait) const;
+    // waits for the fill in progress, if any, and paints it
+    void finishFill();
+    void applyFill();
+    // the spans of the texels connected to (x, y) that are inside: inside(y, mask) sets mask[x] of the texels of row y
+    // to 1 if they are, 0 otherwise
+    template <class Inside>
+    static void scanline(int w, int h, int x, int y, Inside inside, std::vector<Span>& spans);
+
+    int m_width;
+    int m_height;
+    std::vector<unsigned char> m_pixels;
+    std::vector<std::vector<Run>> m_rows; // sorted, neither overlapping nor touching with the same label
+    size_t m_runs = 0;
+
+    std::unique_ptr<TexturedQuad> m_quad;
+    mutable std::vector<Rect> m_dirty; // not uploaded yet
+
+    int m_tiles_x;
+    Step m_open;                   // the step being painted
+    std::vector<unsigned> m_saved; // of each tile, the open step if it is in it
+    unsigned m_step = 1;
+    std::deque<Step> m_undo;       // the oldest first, dropped when over the budget
+    std::vector<Step> m_redo;
+    size_t m_history_bytes = 0;
+
+    std::shared_ptr<Fill> m_fill; // in progress
+};
@@ -1,33 +1,113 @@
 #include "log.hpp"
+#include "log_format.hpp"
 #include "engine.hpp"
 #include "time.h"
 #include "imgui/imgui.h"
+#include "thread_pool.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace Log {
 
 namespace {
+    const int type_count = 7;
+
+    // a line is published with a seqlock, from the sequence of its slot readers tell a line that isn't there yet
+    // from one that is done, was given up or was overwritten. see sequenceBase()
     struct Line {
+        std::atomic<uint64_t> sequence{0};
         uint64_t timestamp;
-        enum Type {
-            Fatal  = 1 << 0, // fatal messages only
-            Error  = 1 << 1, // error messages
-            Warn   = 1 << 2, // warning messages
-            Info   = 1 << 3, // informational messages
-            Status = 1 << 4, // status messages (default)
-            Debug  = 1 << 5, // debug messages
-            Trace  = 1 << 6, // very noisy debug messages
-        } type;
-        std::string content;
+        uint64_t text;   // position in the arena, it wraps around
+        uint32_t length;
+        uint8_t level;
+        bool formatted;  // the text is a format string and its parameters, see detail::log()
+    };
+
+    // for line n, its slot's sequence is below sequenceBase(n) until its writer claims the slot, then:
+    // - base + 1 while the line is written, base + 2 once it is done
+    // - base when its writer gave it up as the writer of an older line is still on the slot, which turns it
+    //   into base + 3 as it leaves. the two writers never write the same line at the same time
+    // all but base + 1 are final, and the sequences of newer lines are above base + 3
+    uint64_t sequenceBase(uint64_t n) { return 4 * n + 4; }
+
+    // an older line's writer is still on the slot, writing or done with a line given up since
+    bool held(uint64_t sequence) { return (sequence & 3) == 1 or (sequence != 0 and (sequence & 3) == 0); }
+
+    // sizes are powers of two, positions are masked instead of wrapped
+    const uint64_t line_capacity = 1 << 14;
+    const uint64_t arena_capacity = 1 << 20;
+    const uint32_t max_length = 4096; // longer lines, or string parameters, are cut
+
+    // producers, any thread
+    std::vector<Line> m_lines(line_capacity);
+    std::vector<char> m_arena(arena_capacity);
+    std::atomic<uint64_t> m_head{0};      // number of lines ever logged
+    std::atomic<uint64_t> m_text_head{0}; // number of bytes ever written to the arena
+    // the lines of each level, so that a filter is rebuilt from the lines it shows rather than from all of them
+    struct LevelIndex {
+        std::vector<std::atomic<uint64_t>> lines = std::vector<std::atomic<uint64_t>>(line_capacity); // line + 1, 0 if empty
+        std::atomic<uint64_t> head{0};
+    };
+    std::array<LevelIndex, type_count> m_levels;
+
+    // line numbers in increasing order, the oldest are dropped when it is full
+    struct IndexRing {
+        std::vector<uint64_t> lines = std::vector<uint64_t>(line_capacity);
+        uint64_t begin = 0;
+        uint64_t end = 0;
+
+        size_t size() const { return end - begin; }
+        uint64_t operator[](size_t i) const { return lines[(begin + i) & (line_capacity - 1)]; }
+        void clear() { begin = end = 0; }
+        void push(uint64_t n) {
+            if (size() == line_capacity)
+                ++begin;
+            lines[end++ & (line_capacity - 1)] = n;
+        }
+        void dropBefore(uint64_t oldest) {
+            while (size() > 0 and (*this)[0] < oldest)
+                ++begin;
+        }
     };
 
+    // consumer, the thread that draws the widget
+    uint8_t m_filter = 0b00011111;
     bool m_wasAtEnd = true;
     bool m_grew = false;
-    uint8_t m_filter = 0b00011111;
+    bool m_show_ms = false;
+    uint64_t m_read = 0;     // the lines before were added to the filtered view if they matched
+    uint64_t m_cleared = 0;  // the lines before are hidden
+    IndexRing m_filtered;
+
+    // search, a worker goes through the lines there when it starts and sync() through the new ones
+    char m_query[128] = "";
+    std::string m_search;    // lower case, empty when not searching
+    uint64_t m_search_end = 0;
+    std::atomic<uint64_t> m_search_generation{0};
+    std::atomic<uint64_t> m_search_done{0};
+    std::mutex m_found_mutex;
+    std::vector<uint64_t> m_found_pending; // from the worker, not in m_found yet
+    IndexRing m_found;       // before m_search_end
+    IndexRing m_found_live;  // after
 
-    std::vector<Line> m_log; // TODO: replace with ringbuffer
-    std::vector<int> m_filtered;
+    // recording to a file, lines are added to a buffer as sync() goes through them
+    const size_t record_buffer_size = 1 << 16;
+    std::FILE* m_record = nullptr;
+    std::string m_record_path;
+    std::vector<char> m_record_buffer;
+    std::unordered_map<const char*, uint64_t> m_record_templates;
+    uint64_t m_record_timestamp = 0;
+    uint64_t m_record_lost = 0; // lines missed since the last one recorded, written as a gap before the next
 
     uint64_t getTimeAsMs() {
         struct timespec spec;
@@ -35,40 +115,534 @@ namespace {
         return spec.tv_sec * 1000 + spec.tv_nsec / 1.0e6;
     }
 
-    void Log(Line::Type t, std::string s) {
-        if (t & m_filter) {
-            m_filtered.push_back(m_log.size());
+#ifndef __EMSCRIPTEN__
+    bool shown(Level level) {
+        return m_filter & (1 << (int)level);
+    }
+#endif
+
+    // the arena wraps around, a line can start at its end and continue at its beginning
+    void arenaWrite(uint64_t& position, const void* data, size_t size) {
+        const uint64_t offset = position & (arena_capacity - 1);
+        const uint64_t first = std::min<uint64_t>(size, arena_capacity - offset);
+        std::memcpy(&m_arena[offset], data, first);
+        std::memcpy(&m_arena[0], (const char*)data + first, size - first);
+        position += size;
+    }
+
+    template<typename T>
+    void arenaWrite(uint64_t& position, const T& value) {
+        arenaWrite(position, &value, sizeof(T));
+    }
+
+    // claims a line and length bytes of the arena, write() fills them
+    template<typename Write>
+    void append(Level level, uint32_t length, bool formatted, Write&& write) {
+        const uint64_t text = m_text_head.fetch_add(length, std::memory_order_relaxed);
+        const uint64_t n = m_head.fetch_add(1, std::memory_order_relaxed);
+
+        // a writer that went around the whole ring while another one is still on the slot gives up its line,
+        // rather than both writing it at the same time. as does one that a newer line overtook
+        auto& line = m_lines[n & (line_capacity - 1)];
+        const uint64_t base = sequenceBase(n);
+        uint64_t sequence = line.sequence.load(std::memory_order_relaxed);
+        bool given_up;
+        do {
+            if (sequence >= base)
+                return;
+            given_up = held(sequence);
+        } while (!line.sequence.compare_exchange_weak(sequence, given_up ? base : base + 1, std::memory_order_acq_rel, std::memory_order_relaxed));
+        if (given_up)
+            return;
+
+        uint64_t position = text;
+        write(position);
+        line.timestamp = getTimeAsMs();
+        line.text = text;
+        line.length = length;
+        line.level = (uint8_t)level;
+        line.formatted = formatted;
+        // the line is done, unless a newer one was given up in the meantime: that one is then final
+        sequence = base + 1;
+        while (!line.sequence.compare_exchange_weak(sequence, sequence == base + 1 ? base + 2 : sequence + 3,
+                                                    std::memory_order_release, std::memory_order_relaxed));
+        if (sequence != base + 1)
+            return;
+
+        auto& index = m_levels[line.level];
+        const uint64_t i = index.head.fetch_add(1, std::memory_order_relaxed);
+        index.lines[i & (line_capacity - 1)].store(n + 1, std::memory_order_release);
+
+        Engine::request_frames();
+    }
+
+    void Log(Level level, std::string_view s) {
+#ifndef __EMSCRIPTEN__
+        // no log window when headless
+        if (shown(level))
+            std::fprintf(stderr, "%.*s\n", (int)s.size(), s.data());
+#endif
+        const uint32_t length = std::min<size_t>(s.size(), max_length);
+        append(level, length, false, [&](uint64_t& position) {
+            arenaWrite(position, s.data(), length);
+        });
+    }
+
+    // formats in out, which keeps its capacity from line to line
+    void render(std::string_view fmt, const detail::Arg* args, size_t count, std::string& out) {
+        out.clear();
+        ::detail::format_parse(::detail::StringView(fmt.data(), fmt.data() + fmt.size()), count,
+            [&](const char* begin, const char* end) { out.append(begin, end); },
+            [&](size_t index) {
+                const auto& a = args[index];
+                char number[32];
+                switch (a.type) {
+                    case detail::Arg::Int:    out.append(number, std::to_chars(number, number + sizeof(number), a.i).ptr); break;
+                    case detail::Arg::UInt:   out.append(number, std::to_chars(number, number + sizeof(number), a.u).ptr); break;
+                    case detail::Arg::Float:  out.append(number, std::snprintf(number, sizeof(number), "%g", a.f)); break;
+                    case detail::Arg::Char:   out += a.c; break;
+                    case detail::Arg::Bool:   out += a.b ? "true" : "false"; break;
+                    case detail::Arg::String: out.append(a.s.data(), a.s.size()); break;
+                }
+            });
+    }
+
+    // a line out of the ring, the buffers keep their capacity when it is reused
+    struct LineCopy {
+        uint64_t timestamp;
+        int level;
+        std::string text;
+        std::string raw; // the bytes from the arena, the format and parameters of a formatted line
+        bool formatted;
+        std::vector<detail::Arg> args;
+    };
+
+    // decodes what detail::log() wrote: returns the format, the parameters go to args and their strings point into raw
+    std::string_view decodeFormatted(LineCopy& line) {
+        const auto& raw = line.raw;
+        size_t position = 0;
+        auto get = [&](auto& value) {
+            std::memcpy(&value, raw.data() + position, sizeof(value));
+            position += sizeof(value);
+        };
+        const char* fmt;
+        uint32_t fmt_length;
+        uint8_t count;
+        get(fmt);
+        get(fmt_length);
+        get(count);
+        line.args.resize(count);
+        for (auto& a : line.args) {
+            get(a.type);
+            switch (a.type) {
+                case detail::Arg::Int:   get(a.i); break;
+                case detail::Arg::UInt:  get(a.u); break;
+                case detail::Arg::Float: get(a.f); break;
+                case detail::Arg::Char:  get(a.c); break;
+                case detail::Arg::Bool:  get(a.b); break;
+                case detail::Arg::String: {
+                    uint32_t length;
+                    get(length);
+                    a.s = std::string_view(raw.data() + position, length);
+                    position += length;
+                    break;
+                }
+            }
+        }
+        return std::string_view(fmt, fmt_length);
+    }
+
+    // false if the line isn't written yet or was overwritten since, the copy is then garbage. any thread
+    bool copy(uint64_t n, LineCopy& out) {
+        const auto& line = m_lines[n & (line_capacity - 1)];
+        const uint64_t done = sequenceBase(n) + 2;
+        if (line.sequence.load(std::memory_order_acquire) != done)
+            return false;
+        out.timestamp = line.timestamp;
+        out.level = line.level;
+        out.formatted = line.formatted;
+        const uint64_t text = line.text;
+        const uint64_t offset = text & (arena_capacity - 1);
+        const uint64_t first = std::min<uint64_t>(line.length, arena_capacity - offset);
+        out.raw.assign(&m_arena[offset], first);
+        out.raw.append(&m_arena[0], line.length - first);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (line.sequence.load(std::memory_order_relaxed) != done
+            or m_text_head.load(std::memory_order_relaxed) - text > arena_capacity)
+            return false;
+        return true;
+    }
+
+    // copy() and the line's text. any thread
+    bool read(uint64_t n, LineCopy& out) {
+        if (!copy(n, out))
+            return false;
+        // only now that the copy is known to be whole
+        if (out.formatted) {
+            const auto fmt = decodeFormatted(out);
+            render(fmt, out.args.data(), out.args.size(), out.text);
+        } else {
+            out.text.swap(out.raw);
+        }
+        return true;
+    }
+
+    void flushRecording() {
+        if (m_record and !m_record_buffer.empty()
+            and std::fwrite(m_record_buffer.data(), 1, m_record_buffer.size(), m_record) != m_record_buffer.size()) {
+            std::fclose(m_record);
+            m_record = nullptr;
+            Log(Level::Error, "Can't write the log recording, it is stopped");
+        }
+        m_record_buffer.clear();
+    }
+
+    void recordGap() {
+        if (m_record_lost == 0)
+            return;
+        m_record_buffer.push_back(LogFormat::Gap);
+        LogFormat::putVarint(m_record_buffer, m_record_lost);
+        m_record_lost = 0;
+    }
+
+    // writes the lines sync() goes through, see log_format.hpp
+    void record(uint64_t n) {
+        static LineCopy line;
+        if (!copy(n, line)) {
+            ++m_record_lost;
+            return;
+        }
+        recordGap();
+        auto& out = m_record_buffer;
+        uint64_t id = 0;
+        std::string_view fmt;
+        if (line.formatted) {
+            // the format strings are literals, their address is enough to tell them apart
+            fmt = decodeFormatted(line);
+            auto [it, added] = m_record_templates.emplace(fmt.data(), m_record_templates.size() + 1);
+            id = it->second;
+            if (added) {
+                out.push_back(LogFormat::Template);
+                LogFormat::putVarint(out, id);
+                LogFormat::putVarint(out, fmt.size());
+                out.insert(out.end(), fmt.begin(), fmt.end());
+            }
+        }
+        out.push_back(LogFormat::Line);
+        LogFormat::putVarint(out, LogFormat::zigzag(line.timestamp - m_record_timestamp));
+        m_record_timestamp = line.timestamp;
+        out.push_back(line.level);
+        LogFormat::putVarint(out, id);
+        if (!line.formatted) {
+            LogFormat::putVarint(out, line.raw.size());
+            out.insert(out.end(), line.raw.begin(), line.raw.end());
+        } else {
+            out.push_back(line.args.size());
+            for (const auto& a : line.args) {
+                out.push_back(a.type);
+                switch (a.type) {
+                    case detail::Arg::Int:   LogFormat::putVarint(out, LogFormat::zigzag(a.i)); break;
+                    case detail::Arg::UInt:  LogFormat::putVarint(out, a.u); break;
+                    case detail::Arg::Float: out.insert(out.end(), (const char*)&a.f, (const char*)&a.f + sizeof(a.f)); break;
+                    case detail::Arg::Char:  out.push_back(a.c); break;
+                    case detail::Arg::Bool:  out.push_back(a.b); break;
+                    case detail::Arg::String:
+                        LogFormat::putVarint(out, a.s.size());
+                        out.insert(out.end(), a.s.begin(), a.s.end());
+                        break;
+                }
+            }
+        }
+        if (out.size() >= record_buffer_size)
+            flushRecording();
+    }
+
+    bool contains(const std::string& text, const std::string& lower_query) {
+        auto it = std::search(text.begin(), text.end(), lower_query.begin(), lower_query.end(),
+            [](char a, char b) { return std::tolower((unsigned char)a) == b; });
+        return it != text.end() or lower_query.empty();
+    }
+
+    uint64_t oldestKept() {
+        const uint64_t head = m_head.load(std::memory_order_acquire);
+        return std::max(m_cleared, head > line_capacity ? head - line_capacity : 0);
+    }
+
+    // adds the lines published since the last call, in order: stops at a line not written yet, or still being
+    // written. a writer always ends, by publishing its line or giving it up
+    void sync() {
+        // overwritten before they were read: the ring is too small for what was logged since the last frame
+        if (const uint64_t oldest = oldestKept(); m_read < oldest) {
+            if (m_record)
+                m_record_lost += oldest - m_read;
+            m_read = oldest;
+        }
+        const uint64_t head = m_head.load(std::memory_order_acquire);
+        for (; m_read < head; ++m_read) {
+            const auto& line = m_lines[m_read & (line_capacity - 1)];
+            const uint64_t sequence = line.sequence.load(std::memory_order_acquire);
+            const uint64_t base = sequenceBase(m_read);
+            if (sequence < base or sequence == base + 1)
+                break;
+            // given up, or overwritten already
+            if (sequence != base + 2) {
+                if (m_record)
+                    ++m_record_lost;
+                continue;
+            }
+            if (m_record)
+                record(m_read);
+            if (!(m_filter & (1 << line.level)))
+                continue;
+            m_filtered.push(m_read);
             m_grew = true;
+            // new lines are searched here, a line at a time
+            if (!m_search.empty() and m_read >= m_search_end) {
+                static LineCopy line_copy;
+                if (read(m_read, line_copy) and contains(line_copy.text, m_search))
+                    m_found_live.push(m_read);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_found_mutex);
+            for (auto n : m_found_pending)
+                m_found.push(n);
+            m_found_pending.clear();
+        }
+        const uint64_t oldest = oldestKept();
+        m_filtered.dropBefore(oldest);
+        m_found.dropBefore(oldest);
+        m_found_live.dropBefore(oldest);
+    }
+
+    // from the level indices, only walks the lines of the selected levels
+    void rebuildFiltered() {
+        m_filtered.clear();
+        const uint64_t oldest = oldestKept();
+        static std::vector<uint64_t> lines;
+        lines.clear();
+        for (int level = 0; level < type_count; ++level) {
+            if (!(m_filter & (1 << level)))
+                continue;
+            const auto& index = m_levels[level];
+            const uint64_t head = index.head.load(std::memory_order_acquire);
+            for (uint64_t i = head > line_capacity ? head - line_capacity : 0; i < head; ++i) {
+                const uint64_t n = index.lines[i & (line_capacity - 1)].load(std::memory_order_acquire);
+                if (n != 0 and n - 1 >= oldest and n - 1 < m_read)
+                    lines.push_back(n - 1);
+            }
+        }
+        // the levels are each in order, but interleaved
+        std::sort(lines.begin(), lines.end());
+        for (auto n : lines)
+            m_filtered.push(n);
+    }
+
+    // the lines already there are searched on a worker, the results come in a batch at a time.
+    // a new search makes the worker of the previous one stop
+    void startSearch() {
+        const uint64_t generation = ++m_search_generation;
+        m_found.clear();
+        m_found_live.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_found_mutex);
+            m_found_pending.clear();
+        }
+        m_search = m_query;
+        for (auto& c : m_search)
+            c = std::tolower((unsigned char)c);
+        if (m_search.empty()) {
+            m_search_done = generation;
+            return;
+        }
+        m_search_end = m_read;
+        ThreadPool::global().submit([generation, begin = oldestKept(), end = m_search_end, filter = m_filter, query = m_search] {
+            LineCopy line;
+            std::vector<uint64_t> batch;
+            auto flush = [&] {
+                std::lock_guard<std::mutex> lock(m_found_mutex);
+                if (m_search_generation == generation)
+                    m_found_pending.insert(m_found_pending.end(), batch.begin(), batch.end());
+                batch.clear();
+            };
+            for (uint64_t n = begin; n < end and m_search_generation == generation; ++n) {
+                if (read(n, line) and (filter & (1 << line.level)) and contains(line.text, query))
+                    batch.push_back(n);
+                if (batch.size() == 256 or (n & 4095) == 4095) {
+                    flush();
+                    Engine::request_frames();
+                }
+            }
+            flush();
+            m_search_done = generation;
+            Engine::request_frames();
+        });
+    }
+
+    // the prefix of a line, "hh:mm:ss.mmm", without going through std::string
+    void formatTimestamp(uint64_t timestamp, bool hours, bool ms, char* out) {
+        auto put = [&](uint64_t value, int digits) {
+            for (int i = digits - 1; i >= 0; --i, value /= 10)
+                out[i] = '0' + value % 10;
+            out += digits;
+        };
+        if (hours) {
+            put(timestamp / (60 * 60 * 1000) % 100, 2);
+            *out++ = ':';
+        }
+        put((timestamp / (60 * 1000)) % 60, 2);
+        *out++ = ':';
+        put((timestamp / 1000) % 60, 2);
+        if (ms) {
+            *out++ = '.';
+            put(timestamp % 1000, 3);
+        }
+        *out = '\0';
+    }
+
+    // the lines on screen, made once rather than every frame. direct mapped by line number,
+    // bigger than any window is tall
+    struct CachedLine {
+        uint64_t line = UINT64_MAX;
+        int style = -1; // the parts of the timestamp in the prefix
+        bool valid = false;
+        char prefix[16];
+        std::string text;
+    };
+    std::array<CachedLine, 256> m_cache;
+
+    const CachedLine& cached(uint64_t n, bool hours) {
+        const int style = hours * 2 + m_show_ms;
+        auto& c = m_cache[n % m_cache.size()];
+        if (c.line == n and c.style == style)
+            return c;
+        static LineCopy line_copy;
+        c.line = n;
+        c.style = style;
+        c.valid = read(n, line_copy);
+        if (c.valid) {
+            formatTimestamp(line_copy.timestamp, hours, m_show_ms, c.prefix);
+            c.text.swap(line_copy.text);
+        }
+        return c;
+    }
+}
+
+void Fatal(std::string_view s)  { Log(Level::Fatal,  s); }
+void Error(std::string_view s)  { Log(Level::Error,  s); }
+void Warn(std::string_view s)   { Log(Level::Warn,   s); }
+void Info(std::string_view s)   { Log(Level::Info,   s); }
+void Status(std::string_view s) { Log(Level::Status, s); }
+void Debug(std::string_view s)  { Log(Level::Debug,  s); }
+void Trace(std::string_view s)  { Log(Level::Trace,  s); }
+
+namespace detail {
+    // the format string is a literal, only its address is stored. the parameters follow, each as its type and value
+    void log(Level level, std::string_view fmt, const Arg* args, size_t count) {
+#ifndef __EMSCRIPTEN__
+        if (shown(level)) {
+            thread_local std::string text;
+            render(fmt, args, count, text);
+            std::fprintf(stderr, "%s\n", text.c_str());
+        }
+#endif
+        uint32_t length = sizeof(const char*) + sizeof(uint32_t) + sizeof(uint8_t);
+        for (size_t i = 0; i < count; ++i) {
+            length += sizeof(Arg::Type);
+            switch (args[i].type) {
+                case Arg::Int:    length += sizeof(int64_t); break;
+                case Arg::UInt:   length += sizeof(uint64_t); break;
+                case Arg::Float:  length += sizeof(double); break;
+                case Arg::Char:   length += sizeof(char); break;
+                case Arg::Bool:   length += sizeof(bool); break;
+                case Arg::String: length += sizeof(uint32_t) + std::min<size_t>(args[i].s.size(), max_length); break;
+            }
         }
-        m_log.push_back(Line{ getTimeAsMs(), t, std::move(s) });
+        append(level, length, true, [&](uint64_t& position) {
+            arenaWrite(position, fmt.data());
+            arenaWrite(position, (uint32_t)fmt.size());
+            arenaWrite(position, (uint8_t)count);
+            for (size_t i = 0; i < count; ++i) {
+                const auto& a = args[i];
+                arenaWrite(position, a.type);
+                switch (a.type) {
+                    case Arg::Int:   arenaWrite(position, a.i); break;
+                    case Arg::UInt:  arenaWrite(position, a.u); break;
+                    case Arg::Float: arenaWrite(position, a.f); break;
+                    case Arg::Char:  arenaWrite(position, a.c); break;
+                    case Arg::Bool:  arenaWrite(position, a.b); break;
+                    case Arg::String: {
+                        const uint32_t size = std::min<size_t>(a.s.size(), max_length);
+                        arenaWrite(position, size);
+                        arenaWrite(position, a.s.data(), size);
+                        break;
+                    }
+                }
+            }
+        });
     }
 }
 
-void Fatal(std::string s)  { Log(Line::Fatal,  std::move(s)); }
-void Error(std::string s)  { Log(Line::Error,  std::move(s)); }
-void Warn(std::string s)   { Log(Line::Warn,   std::move(s)); }
-void Info(std::string s)   { Log(Line::Info,   std::move(s)); }
-void Status(std::string s) { Log(Line::Status, std::move(s)); }
-void Debug(std::string s)  { Log(Line::Debug,  std::move(s)); }
-void Trace(std::string s)  { Log(Line::Trace,  std::move(s)); }
+bool start_recording(const std::string& path) {
+    stop_recording();
+    m_record = std::fopen(path.c_str(), "wb");
+    if (!m_record) {
+        Error(FMT("Can't open {} to record the log"), path);
+        return false;
+    }
+    m_record_path = path;
+    m_record_templates.clear();
+    m_record_timestamp = 0;
+    m_record_lost = 0;
+    m_record_buffer.assign(LogFormat::magic, LogFormat::magic + sizeof(LogFormat::magic));
+    // what sync() went through already, the rest follows as it comes
+    const uint64_t head = m_head.load();
+    for (uint64_t n = head > line_capacity ? head - line_capacity : 0; n < m_read; ++n)
+        record(n);
+    return true;
+}
+
+void stop_recording() {
+    if (!m_record)
+        return;
+    recordGap();
+    flushRecording();
+    if (m_record)
+        std::fclose(m_record);
+    m_record = nullptr;
+}
+
+bool recording() {
+    return m_record != nullptr;
+}
+
+void update() {
+    sync();
+}
 
 void draw_widget() {
+    sync();
+
     auto& in = Engine::input();
     ImGui::SetNextWindowPos(ImVec2((float)in.width / 2, (float)in.height - 150.f), ImGuiCond_FirstUseEver, ImVec2(0.5, 0.5f));
     ImGui::SetNextWindowSize(ImVec2((float)in.width * 3.f / 4.f, 250), ImGuiCond_FirstUseEver);
     ImGui::Begin("Log window");
     if (ImGui::Button("Clear")) {
-        m_log.clear();
+        m_cleared = m_read;
         m_filtered.clear();
+        if (!m_search.empty())
+            startSearch();
     }
     ImGui::SameLine();
     if (ImGui::BeginCombo("", "Filters"))
     {
-        static const std::vector<const char*> filter_names = { "Fatal", "Error", "Warn", "Info", "Status", "Debug", "Trace" };
         bool modified = false;
-        for (int i = 0; i < 7; i++) {
+        for (int i = 0; i < type_count; i++) {
             bool selected = m_filter & (1 << i);
-            if (ImGui::Selectable(filter_names[i], selected, ImGuiSelectableFlags_DontClosePopups)) {
+            // the count of lines ever logged, not only of those kept. it changes the label, not the id after ###
+            char name[48];
+            std::snprintf(name, sizeof(name), "%s (%llu)###filter%d", LogFormat::level_names[i], (unsigned long long)m_levels[i].head.load(), i);
+            if (ImGui::Selectable(name, selected, ImGuiSelectableFlags_DontClosePopups)) {
                 modified = true;
                 if (selected)
                     m_filter &= ~(1 << i);
@@ -78,48 +652,56 @@ void draw_widget() {
         }
         ImGui::EndCombo();
         if (modified) {
-            m_filtered.clear();
-            for (int i = 0; i < m_log.size(); ++i)
-                if (m_filter & m_log[i].type)
-                    m_filtered.push_back(i);
+            rebuildFiltered();
+            if (!m_search.empty())
+                startSearch();
         }
     }
     ImGui::SameLine();
-    static bool showMs = false;
-    ImGui::Checkbox("Show ms", &showMs);
+    ImGui::Checkbox("Show ms", &m_show_ms);
+    ImGui::SameLine();
+    bool record = recording();
+    if (ImGui::Checkbox("Record", &record)) {
+        if (record)
+            start_recording("session.natlog");
+        else
+            stop_recording();
+    }
+    if (ImGui::IsItemHovered())
+        ImGui::SetTooltip("to %s, in the binary format of log_format.hpp", recording() ? m_record_path.c_str() : "session.natlog");
+    ImGui::SameLine();
+    ImGui::PushItemWidth(200.f);
+    if (ImGui::InputText("Search", m_query, sizeof(m_query)))
+        startSearch();
+    ImGui::PopItemWidth();
+    const bool searching = !m_search.empty();
+    if (searching) {
+        ImGui::SameLine();
+        if (m_search_done != m_search_generation)
+            ImGui::Text("searching... %d found", (int)(m_found.size() + m_found_live.size()));
+        else
+            ImGui::Text("%d found", (int)(m_found.size() + m_found_live.size()));
+    }
 
     ImGui::BeginChild("Log", {0,0}, false, ImGuiWindowFlags_AlwaysVerticalScrollbar);
         ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(0,0));
 
-        ImGuiListClipper clipper(m_filtered.size());
-        bool show_hours = !m_log.empty() and m_log.back().timestamp > (60 * 60 * 1000);
-        std::vector<int> range;
+        // the results of a search are shown instead of the filtered lines, the older first
+        const size_t count = searching ? m_found.size() + m_found_live.size() : m_filtered.size();
+        auto line_at = [&](size_t i) {
+            if (!searching)
+                return m_filtered[i];
+            return i < m_found.size() ? m_found[i] : m_found_live[i - m_found.size()];
+        };
+        ImGuiListClipper clipper(count);
+        const bool show_hours = getTimeAsMs() > (60 * 60 * 1000);
         while (clipper.Step()) {
-            range.push_back(clipper.DisplayStart);
-            range.push_back(clipper.DisplayEnd);
             for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
-                const auto& line = m_log[m_filtered[i]];
-                std::string s;
-                s.reserve(12);
-                auto add_num = [&](int i, int pad_to = 2) {
-                    int cop = i;
-                    while (i /= 10) pad_to--;
-                    for (int i = 1; i < pad_to; ++i)
-                        s += '0';
-                    s += std::to_string(cop);
-                };
-                if (show_hours) {
-                    add_num(line.timestamp / (60 * 60 * 1000));
-                    s += ":";
-                }
-                add_num((line.timestamp / (60 * 1000)) % 60);
-                s += ":";
-                add_num((line.timestamp / 1000) % 60);
-                if (showMs) {
-                    s += ".";
-                    add_num(line.timestamp % 1000, 3);
-                }
-                ImGui::Text("%s | %s", s.c_str(), line.content.c_str());
+                const auto& line = cached(line_at(i), show_hours);
+                if (line.valid)
+                    ImGui::Text("%s | %s", line.prefix, line.text.c_str());
+                else
+                    ImGui::TextDisabled("(overwritten)");
             }
         }
 
@@ -1,15 +1,106 @@
 #pragma once
 
+#include "utils.hpp"
+
+#include <array>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <type_traits>
 
+// callable from any thread, the lines go to a fixed size ring buffer and the oldest are dropped
 namespace Log {
-    void Fatal(std::string s);
-    void Error(std::string s);
-    void Warn(std::string s);
-    void Info(std::string s);
-    void Status(std::string s);
-    void Debug(std::string s);
-    void Trace(std::string s);
+    enum class Level : uint8_t { Fatal, Error, Warn, Info, Status, Debug, Trace };
+
+    namespace detail {
+        // a parameter of a formatted line, stored as it is and only turned into text when displayed
+        struct Arg {
+            enum Type : uint8_t { Int, UInt, Float, Char, Bool, String } type;
+            union {
+                int64_t i;
+                uint64_t u;
+                double f;
+                char c;
+                bool b;
+            };
+            std::string_view s;
+        };
+
+        template<typename> constexpr bool unsupported = false;
+
+        template<typename T>
+        Arg arg(const T& v) {
+            Arg a{};
+            if constexpr (std::is_same_v<T, bool>) {
+                a.type = Arg::Bool;
+                a.b = v;
+            } else if constexpr (std::is_same_v<T, char>) {
+                a.type = Arg::Char;
+                a.c = v;
+            } else if constexpr (std::is_integral_v<T> or std::is_enum_v<T>) {
+                if constexpr (std::is_signed_v<T> or std::is_enum_v<T>) {
+                    a.type = Arg::Int;
+                    a.i = (int64_t)v;
+                } else {
+                    a.type = Arg::UInt;
+                    a.u = v;
+                }
+            } else if constexpr (std::is_floating_point_v<T>) {
+                a.type = Arg::Float;
+                a.f = v;
+            } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+                a.type = Arg::String;
+                a.s = v;
+            } else {
+                static_assert(unsupported<T>, "can't log this type, only numbers, bools, chars and strings");
+            }
+            return a;
+        }
+
+        void log(Level level, std::string_view fmt, const Arg* args, size_t count);
+
+        template<typename Fmt, typename... Args>
+        void log(Level level, const Args&... args) {
+            constexpr int count = ::detail::format_param_count(Fmt::value());
+            static_assert(count >= 0, "malformed format string");
+            static_assert(count == sizeof...(Args), "the format string doesn't use as many parameters as given");
+            static_assert(sizeof...(Args) < 256, "too many parameters");
+            const std::array<Arg, sizeof...(Args)> a = {{ arg(args)... }};
+            log(level, Fmt::value(), a.data(), a.size());
+        }
+    }
+
+    void Fatal(std::string_view s);
+    void Error(std::string_view s);
+    void Warn(std::string_view s);
+    void Info(std::string_view s);
+    void Status(std::string_view s);
+    void Debug(std::string_view s);
+    void Trace(std::string_view s);
+
+    // Log::Info(FMT("{} of {}"), a, b): checked at compile time, doesn't allocate,
+    // and the text is only made if the line is displayed
+    template<typename Fmt, typename... Args, typename = std::enable_if_t<is_format_string<Fmt>>>
+    void Fatal(Fmt, const Args&... args)  { detail::log<Fmt>(Level::Fatal, args...); }
+    template<typename Fmt, typename... Args, typename = std::enable_if_t<is_format_string<Fmt>>>
+    void Error(Fmt, const Args&... args)  { detail::log<Fmt>(Level::Error, args...); }
+    template<typename Fmt, typename... Args, typename = std::enable_if_t<is_format_string<Fmt>>>
+    void Warn(Fmt, const Args&... args)   { detail::log<Fmt>(Level::Warn, args...); }
+    template<typename Fmt, typename... Args, typename = std::enable_if_t<is_format_string<Fmt>>>
+    void Info(Fmt, const Args&... args)   { detail::log<Fmt>(Level::Info, args...); }
+    template<typename Fmt, typename... Args, typename = std::enable_if_t<is_format_string<Fmt>>>
+    void Status(Fmt, const Args&... args) { detail::log<Fmt>(Level::Status, args...); }
+    template<typename Fmt, typename... Args, typename = std::enable_if_t<is_format_string<Fmt>>>
+    void Debug(Fmt, const Args&... args)  { detail::log<Fmt>(Level::Debug, args...); }
+    template<typename Fmt, typename... Args, typename = std::enable_if_t<is_format_string<Fmt>>>
+    void Trace(Fmt, const Args&... args)  { detail::log<Fmt>(Level::Trace, args...); }
+
+    // records every line to a file as it comes, starting with those still in memory, see log_format.hpp
+    bool start_recording(const std::string& path);
+    void stop_recording();
+    bool recording();
 
+    // brings the log window and the recording up to date, once a frame
+    void update();
     void draw_widget();
 }
@@ -0,0 +1,47 @@
+#pragma once
+
+// the binary log written by Log::start_recording(), and read by the natlog tool (src/platform/native/natlog.cpp).
+//
+// it starts with the magic, followed by records, each starting with its type:
+// - Template: id, length, then the bytes of a format string. ids start at 1, and are defined before being used
+// - Line: timestamp in ms as a difference to the previous line's (zigzag, lines from different threads can be a bit
+//   out of order), level, template id or 0 for a plain line. then for a plain line its length and bytes, and for a
+//   formatted one its parameter count, followed by each parameter's Log::detail::Arg::Type and value:
+//   ints zigzag, unsigned ints as they are, doubles as 8 bytes, chars and bools as 1 byte, strings as length and bytes
+// - Gap: count of lines missing there, overwritten in the ring before the recording got to them, or given up by their
+//   writers (see log.cpp)
+// integers are LEB128 varints unless said otherwise, everything is little endian
+
+#include <cstdint>
+#include <vector>
+
+namespace LogFormat {
+    const char magic[8] = { 'N', 'A', 'T', 'L', 'O', 'G', '1', '\n' };
+
+    enum Record : uint8_t { Template = 1, Line = 2, Gap = 3 };
+
+    const char* const level_names[] = { "Fatal", "Error", "Warn", "Info", "Status", "Debug", "Trace" };
+
+    inline uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+    inline int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+    inline void putVarint(std::vector<char>& out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back((char)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((char)v);
+    }
+
+    // false if the data ends in the middle of it
+    inline bool getVarint(const char*& p, const char* end, uint64_t& v) {
+        v = 0;
+        for (int shift = 0; p != end and shift < 64; shift += 7) {
+            const uint8_t byte = *p++;
+            v |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+}
@@ -1,25 +1,35 @@
 #include "engine.hpp"
 #include "cube.hpp"
 #include "textured_quad.hpp"
+#include "label_map.hpp"
+#include "image_decoder.hpp"
 #include "scancodes.hpp"
 #include "camera.hpp"
 #include "volume.hpp"
+#include "volume_loader.hpp"
 #include "manipulator.hpp"
 #include "utils.hpp"
 #include "log.hpp"
+#include "profiler.hpp"
+#include "png.hpp"
+#include "readback.hpp"
+#include "thread_pool.hpp"
 
 #include "imgui/imgui.h"
+#ifdef __EMSCRIPTEN__
 #include "emscripten.h"
+#endif
 
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <unistd.h>
 
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <functional>
 
@@ -32,21 +42,37 @@
 #define STBI_NO_PNM
 #include "stb/stb_image.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#define STBI_WRITE_NO_STDIO
-
-#include "stb/stb_image_write.h"
-
 using namespace std::string_literals;
 
 namespace {
     bool log_window = true;
+    bool profiler_window = false;
 
     bool painting_mode = false;
     float label_opacity = 0.5f;
     float label_radius = 20.f;
     int label_color = 1;
 
+    enum LabelTool { Brush, BucketFill, RegionGrow };
+    const std::vector<const char*> label_tools = { "Brush", "Bucket fill", "Region grow" };
+    int label_tool = Brush;
+    int grow_tolerance = 16; // of the image's intensity, out of 255
+    bool fill_clicked = false; // the button is still held
+    bool brushing = false;     // the button is still held, the strokes since it was pressed are one step
+    bool brush_picked = false; // brush_last is on the image
+    glm::vec2 brush_last;      // in [0, 1] texture coordinates
+
+    // the labels are saved while they change, read back from their texture without waiting for the gpu
+    bool autosave = false;
+    const char* const autosave_path = "labels_autosave.png";
+    const double autosave_interval = 10.0; // seconds
+    unsigned long autosaved_revision = 0;
+    std::chrono::steady_clock::time_point autosaved_time;
+    std::atomic<bool> autosave_pending = false; // a read back or an encode is in flight, the next one waits
+
+    bool bricked_volumes = false;
+    int progressive_samples = 0; // 0 renders every frame from scratch
+
     const std::vector<const char*> label_sizes = { "128", "256", "512", "1024", "2048", "4096" };
     int label_width = 0;  // just an index, the real value is (128 * (1 << index))
     int label_height = 0; // same
@@ -54,82 +80,234 @@ namespace {
     std::unique_ptr<Manipulator> manip;
     std::unique_ptr<Cube> cube;
     std::unique_ptr<Volume> volume;
-    std::unique_ptr<TexturedQuad> labels;
+    std::unique_ptr<LabelMap> labels;
     std::unique_ptr<TexturedQuad> quad;
 
-    std::vector<unsigned char> current_image_data;
+    Bytes current_image_data; // the file, shared with the decoder
+    ImageDecoder decoder;
+    LabelMap::Image decoded; // for the region growing
 
     ScreenPartition part;
 }
 
 
-void stbi_write_callback(void *context, void *data, int size) {
-    auto& png = *reinterpret_cast<std::vector<unsigned char>*>(context);
-    auto old_size = png.size();
-    png.resize(old_size + size);
-    std::memcpy(&png[old_size], data, size);
-}
 bool pixels_to_png(const std::vector<unsigned char>& pixels, int width, int height, int channels, std::vector<unsigned char>& png) {
-    int res = stbi_write_png_to_func(stbi_write_callback, &png, width, height, channels, pixels.data(), width * channels);
-    return res != 0;
+    return Png::encode(pixels.data(), width, height, channels, png);
 }
 
 void resetLabels() {
-    labels.reset(new TexturedQuad(128 * (1 << label_width), 128 * (1 << label_height), 3, true));
+    labels.reset(new LabelMap(128 * (1 << label_width), 128 * (1 << label_height)));
+    autosaved_revision = 0;
+    brushing = false;
 }
 
-bool loadImageToQuad(const unsigned char* image_data, int size)
+// the png is encoded and written on the thread pool, the next save starts once this one is done
+void saveLabels(const TexturedQuad& texture)
 {
-    int w, h, channels;
-    unsigned char* mem = stbi_load_from_memory(image_data, size, &w, &h, &channels, 4);
-    if (!mem) {
-        Log::Error("failed to load image");
-        return false;
+    autosave_pending = true;
+    autosaved_revision = texture.revision();
+    autosaved_time = std::chrono::steady_clock::now();
+    texture.exportPixelsAsync([w = texture.width(), h = texture.height()](std::vector<unsigned char>&& pixels) {
+        ThreadPool::global().submit([w, h, pixels = std::move(pixels)] {
+            PROFILE_SCOPE("autosave");
+            std::vector<unsigned char> png;
+            // rows from the bottom, like the texture
+            std::ofstream out(autosave_path, std::ios::binary);
+            if (!Png::encode(pixels.data(), w, h, 1, png, Png::default_level, true)
+                or !out.write((const char*)png.data(), png.size()))
+                Log::Error(FMT("Can't save the labels to {}"), autosave_path);
+            autosave_pending = false;
+        });
+    });
+}
+
+void autosaveLabels()
+{
+    if (!autosave or !labels or autosave_pending)
+        return;
+    const auto& texture = labels->quad();
+    if (texture.revision() != autosaved_revision
+        and std::chrono::steady_clock::now() - autosaved_time >= std::chrono::duration<double>(autosave_interval))
+        saveLabels(texture);
+}
+
+// the stages of a decode replace each other in the quad, see ImageDecoder
+void pollImage()
+{
+    auto image = decoder.poll();
+    if (!image)
+        return;
+    if (image->stage == ImageDecoder::Failed) {
+        quad.reset(); // the placeholder
+        decoded = {};
+        return;
     }
-    quad.reset(new TexturedQuad(mem, w, h, 4));
-    stbi_image_free(mem);
+    if (image->tiles)
+        quad.reset(new TexturedQuad(std::move(image->tiles)));
+    else
+        quad.reset(new TexturedQuad(image->pixels.get(), image->width, image->height, image->channels, false, image->type));
+    if (image->stage == ImageDecoder::Done) {
+        current_image_data = std::move(image->encoded);
+        decoded = { image->pixels, image->width, image->height, image->channels, image->type };
+    }
+}
+
+// the image shows up in later frames, see pollImage()
+bool loadImage(Bytes data)
+{
+    if (!decoder.start(std::move(data), TexturedQuad::max_untiled_size()))
+        return false;
+    decoded = {};
+    cube.reset();
+    volume.reset();
+    manip.reset();
     return true;
 }
 
-extern "C" { // necessary to export to js
-    void loadImageFile() {
-        auto fd = open("/file.txt", O_RDONLY);
-        auto close_fd = on_scope_end([&]() { close(fd); });
-        if (fd == -1) {
-            Log::Info("can't open file");
-            return;
-        }
-        struct stat st;
-        fstat(fd, &st);
-        if (S_ISDIR(st.st_mode)) {
-            Log::Info("file is a dir?");
-            return;
-        }
-        if (st.st_size == 0) {
-            Log::Info("file empty?");
-            return;
+bool loadVolumeFile(const std::string& path)
+{
+    int logged = 0;
+    auto loaded = VolumeLoader::load(path, [&](float progress) {
+        int percent = progress * 100;
+        if (percent >= logged + 10 or percent == 100) {
+            Log::Status(FMT("loading volume: {}%"), percent);
+            logged = percent;
         }
+    }, bricked_volumes);
+    if (!loaded)
+        return false;
+    decoder.cancel();
+    decoded = {};
+    manip.reset();
+    cube.reset();
+    quad.reset();
+    volume = std::move(loaded);
+    return true;
+}
+
+void loadFile(const char* path) {
+    Engine::request_frames();
+    auto fd = open(path, O_RDONLY);
+    auto close_fd = on_scope_end([&]() { close(fd); });
+    if (fd == -1) {
+        Log::Info("can't open file");
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (S_ISDIR(st.st_mode)) {
+        Log::Info("file is a dir?");
+        return;
+    }
+    if (st.st_size == 0) {
+        Log::Info("file empty?");
+        return;
+    }
+
+    // stays mapped as long as the decoder or current_image_data need it, without copies
+    auto data = Bytes::map(fd, st.st_size);
+    if (data.empty()) {
+        Log::Info("mmap failed");
+        return;
+    }
+    if (VolumeLoader::isVolumeHeader((const char*)data.data(), data.size())) {
+        loadVolumeFile(path);
+        return;
+    }
+    loadImage(std::move(data));
+}
 
-        auto data = (const unsigned char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (data == MAP_FAILED) {
-            Log::Info("mmap failed");
+// the point of the image under the mouse, in [0, 1] texture coordinates. false if it is in no viewport
+bool pickImage(const Input& in, glm::vec2& uv)
+{
+    const glm::vec2 pos = { (float)in.mousePos.x, (float)(in.height - in.mousePos.y) }; // from the bottom, like the viewports
+    for (auto& cam : part.all_cam) {
+        const auto& v = cam.viewport();
+        if (pos.x < v.x or pos.y < v.y or pos.x >= v.x + v.width or pos.y >= v.y + v.height)
+            continue;
+        const glm::vec2 cursor = { 2.f * (pos.x - v.x) / v.width - 1.f, 2.f * (pos.y - v.y) / v.height - 1.f };
+        glm::vec2 picked;
+        if (!quad->unproject(cam, nullptr, cursor, picked))
+            return false;
+        uv = { (picked.x / quad->ratio() + 1.f) / 2.f, (picked.y + 1.f) / 2.f };
+        return true;
+    }
+    return false;
+}
+
+// a click on the image fills the labels from there, with the fill tools. the camera doesn't turn while it's held
+void handleFillClick(Input& in)
+{
+    if (!in.mouseDown[0]) {
+        fill_clicked = false;
+        return;
+    }
+    if (fill_clicked)
+        in.mouseCaptured = true;
+    if (in.mouseCaptured or !in.mouseStateChanged[0])
+        return;
+    glm::vec2 seed;
+    if (!pickImage(in, seed) or seed.x < 0.f or seed.y < 0.f or seed.x >= 1.f or seed.y >= 1.f)
+        return;
+    if (label_tool == BucketFill)
+        labels->floodFill(seed, label_color);
+    else if (decoded.pixels)
+        labels->grow(seed, label_color, decoded, grow_tolerance);
+    else
+        Log::Info("no image to grow the labels on");
+    fill_clicked = true;
+    in.mouseCaptured = true;
+}
+
+// dragging on the image paints the labels, from where the mouse was the frame before. a press and its drag are one
+// step to undo. the camera doesn't turn while it's held
+void handleBrush(Input& in)
+{
+    if (!in.mouseDown[0]) {
+        if (brushing)
+            labels->endStep();
+        brushing = false;
+        return;
+    }
+    if (!brushing and (in.mouseCaptured or !in.mouseStateChanged[0]))
+        return;
+    if (!brushing) {
+        glm::vec2 uv;
+        // the press starts on the image
+        if (!pickImage(in, uv) or uv.x < 0.f or uv.y < 0.f or uv.x >= 1.f or uv.y >= 1.f)
             return;
-        }
-        auto c = on_scope_end([&]{ munmap((void*)data, st.st_size); });
-        int n = st.st_size;
-        if (loadImageToQuad(data, n)) {
-            cube.reset();
-            volume.reset();
-            manip.reset();
-            current_image_data.resize(n);
-            memcpy(current_image_data.data(), data, n);
-        }
+        brushing = true;
+        brush_picked = false;
+    }
+    in.mouseCaptured = true;
+    glm::vec2 uv;
+    if (!pickImage(in, uv)) {
+        brush_picked = false;
+        return;
+    }
+    if (brush_picked and uv == brush_last)
+        return;
+    // round on screen whatever the size of the labels: x is stretched as much as the image is
+    labels->paint(brush_picked ? brush_last : uv, uv, label_color, label_radius, quad->ratio());
+    brush_last = uv;
+    brush_picked = true;
+}
+
+extern "C" { // necessary to export to js
+    void loadImageFile() {
+        loadFile("/file.txt");
     }
 }
 
 void loop_func()
 {
     auto& in = Engine::input();
+    Log::update();
+    Readback::poll();
+    pollImage();
+    if (labels)
+        labels->poll();
+    autosaveLabels();
 
     //manip->handle_input(part.all_cam[0].projection_view(), in);
     if (in.sizeChanged) {
@@ -138,7 +316,18 @@ void loop_func()
 
     part.draw_delimiters();
 
+    if (painting_mode and label_tool == Brush and quad and labels)
+        handleBrush(in);
+    else if (painting_mode and quad and labels)
+        handleFillClick(in);
+
+    if (volume)
+        volume->set_progressive(progressive_samples);
+    if (quad)
+        quad->set_progressive(progressive_samples);
+
     for (auto& cam : part.all_cam) {
+        PROFILE_SCOPE("camera");
         cam.handle_input(in);
 
         const auto& v = cam.viewport();
@@ -153,7 +342,7 @@ void loop_func()
         else if (cube)
             cube->render(cam, glm::vec3(1,1,1));
         else if (quad and labels)
-            quad->renderWithLabels(cam, *labels, label_opacity);
+            quad->renderWithLabels(cam, labels->quad(), label_opacity);
         else if (quad)
             quad->render(cam);
     }
@@ -178,17 +367,37 @@ void loop_func()
                 manip.reset(new Manipulator);
         }
         if (ImGui::Button("Cube")) {
+            decoder.cancel();
             cube.reset(new Cube);
             volume.reset();
             quad.reset();
             manip.reset();
         }
         if (ImGui::Button("Volume")) {
+            decoder.cancel();
             manip.reset();
             cube.reset();
             quad.reset();
             volume.reset(new Volume({64,64,64}, 4));
         }
+        ImGui::SameLine();
+        ImGui::Checkbox("Bricked", &bricked_volumes);
+        if (volume) {
+            ImGui::Columns(2, NULL, false);
+            if (ImGui::Selectable("Entry/exit", volume->render_mode() == Volume::EntryExitTextures))
+                volume->set_render_mode(Volume::EntryExitTextures);
+            ImGui::NextColumn();
+            if (ImGui::Selectable("Ray-box", volume->render_mode() == Volume::RayBox))
+                volume->set_render_mode(Volume::RayBox);
+            ImGui::Columns(1);
+            float quality = volume->quality();
+            if (ImGui::SliderFloat("Quality", &quality, 0.25f, 4.f, "%.2f samples/voxel"))
+                volume->set_quality(quality);
+            bool interactive = volume->interactive();
+            if (ImGui::Checkbox("Interactive", &interactive))
+                volume->set_interactive(interactive);
+        }
+        ImGui::SliderInt("Progressive", &progressive_samples, 0, 256, progressive_samples ? "%d samples" : "off");
 
         /*if (ImGui::Button("Request random image")) {
             fetchRandomImage();
@@ -197,24 +406,21 @@ void loop_func()
             sendSerializedImage("SendCurrentImage", current_image_data);
         }
         if  (ImGui::Button("Send Labels") && labels) {
-            std::vector<unsigned char> pixels;
-            if (labels->exportPixels(pixels)) {
-                int culled_size = pixels.size() / 3;
-                for (int i = 0; i < culled_size; ++i)
-                    pixels[i] = pixels[i * 3];
-                pixels.resize(culled_size);
-                std::vector<unsigned char> asPng;
-                if (pixels_to_png(pixels, labels->width(), labels->height(), 1, asPng)) {
-                    pixels.clear();
-                    sendSerializedImage("SendLabelImage", asPng);
-                }
-            }
+            std::vector<unsigned char> asPng;
+            if (pixels_to_png(labels->pixels(), labels->width(), labels->height(), 1, asPng))
+                sendSerializedImage("SendLabelImage", Bytes(std::move(asPng)));
+        }
+        if  (ImGui::Button("Send Label Runs") && labels) {
+            sendSerializedImage("SendLabelRuns", Bytes(labels->serialize()));
         }
         if (ImGui::Button("Process")) {
             getProcessingResult();
         }*/
 
         ImGui::Checkbox("Log window", &log_window);
+        ImGui::SameLine();
+        ImGui::Checkbox("Profiler", &profiler_window);
+        ImGui::Checkbox("Render on demand", &Engine::on_demand());
         ImGui::Text("%.2f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 
         pos = ImGui::GetWindowPos();
@@ -248,21 +454,41 @@ void loop_func()
         ImGui::SliderFloat("Opacity", &label_opacity, 0.0f, 1.0f, "%.2f");
         ImGui::SliderFloat("Radius", &label_radius, 1.0f, 100.0f, "%.2f");
         ImGui::SliderInt("Color", &label_color, 0, 2);
-        if (ImGui::Button("Clear"))
-            resetLabels();
+        ImGui::Combo("Tool", &label_tool, label_tools.data(), label_tools.size());
+        if (label_tool == RegionGrow)
+            ImGui::SliderInt("Tolerance", &grow_tolerance, 0, 255);
+        if (ImGui::Button("Clear")) {
+            // to the size chosen above, which can't be undone
+            if (labels and labels->width() == 128 * (1 << label_width) and labels->height() == 128 * (1 << label_height))
+                labels->clear();
+            else
+                resetLabels();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Undo") and labels)
+            labels->undo();
+        ImGui::SameLine();
+        if (ImGui::Button("Redo") and labels)
+            labels->redo();
+        ImGui::Checkbox("Autosave", &autosave);
+        if (ImGui::IsItemHovered())
+            ImGui::SetTooltip("to %s, every %.0f seconds while they change", autosave_path, autosave_interval);
 
         ImGui::End();
     }
 
     if (log_window)
         Log::draw_widget();
+    if (profiler_window)
+        Profiler::draw_widget();
 
     part.all_cam[0].draw_widget();
 
     //ImGui::ShowDemoWindow();
 }
 
-int main()
+// the native build takes a file to open, to render it headless
+int main(int argc, char** argv)
 {
     stbi_set_flip_vertically_on_load(true);
 
@@ -272,7 +498,13 @@ int main()
     for (auto& cam : part.all_cam)
         cam.set_position({0,0,5});
     resetLabels();
+    if (argc > 1) {
+        loadFile(argv[1]);
+        // the native build draws a fixed number of frames, which should all show the image
+        decoder.wait();
+    }
 
     Engine::start();
+    Log::stop_recording();
     Engine::fini();
 }
@@ -0,0 +1,285 @@
+// headless replacement for src/engine.cpp: renders offscreen with EGL, for benchmarks and regression tests
+#include "engine.hpp"
+#include "input.hpp"
+#include "log.hpp"
+#include "profiler.hpp"
+
+#include "imgui/imgui.h"
+#include "imgui_opengles_impl.hpp"
+#include "png.hpp"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES3/gl3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std::string_literals;
+
+namespace Engine {
+namespace {
+    ImGuiIO* m_io;
+    std::function<void()> m_loop_func;
+
+    EGLDisplay m_display = EGL_NO_DISPLAY;
+    EGLSurface m_surface = EGL_NO_SURFACE;
+    EGLContext m_context = EGL_NO_CONTEXT;
+    int m_width = 1280;
+    int m_height = 720;
+    bool m_show_gui = false;
+    bool m_quit = false;
+    std::array<float,4> m_clear_color = {0.2f, 0.4f, 0.6f, 1.f};
+    // fixed step, so that runs are reproducible
+    double m_elapsed_time = 1/60.f;
+    unsigned long m_frame = 0;
+    bool m_on_demand = true;
+    std::atomic<int> m_requested_frames{1};
+
+    // from the environment, see init()
+    int m_frames = 1;
+    std::string m_output;
+
+    Input m_prev_input;
+    Input m_input;
+
+    int envInt(const char* name, int fallback) {
+        const char* s = std::getenv(name);
+        return s ? std::atoi(s) : fallback;
+    }
+
+    bool createContext() {
+        // surfaceless needs neither a display server nor a gpu, mesa falls back to llvmpipe
+        const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+        auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay and extensions and std::strstr(extensions, "EGL_MESA_platform_surfaceless"))
+            m_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if (m_display == EGL_NO_DISPLAY)
+            m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (m_display == EGL_NO_DISPLAY or !eglInitialize(m_display, nullptr, nullptr)) {
+            Log::Fatal("Can't initialize EGL");
+            return false;
+        }
+
+        const EGLint config_attribs[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+            EGL_RED_SIZE, 8,
+            EGL_GREEN_SIZE, 8,
+            EGL_BLUE_SIZE, 8,
+            EGL_ALPHA_SIZE, 8,
+            EGL_DEPTH_SIZE, 24,
+            EGL_NONE
+        };
+        EGLConfig config;
+        EGLint count = 0;
+        if (!eglChooseConfig(m_display, config_attribs, &config, 1, &count) or count == 0) {
+            Log::Fatal("No EGL config for GLES3");
+            return false;
+        }
+        eglBindAPI(EGL_OPENGL_ES_API);
+
+        // a pbuffer rather than no surface at all, so that framebuffer 0 exists like on the web
+        const EGLint surface_attribs[] = { EGL_WIDTH, m_width, EGL_HEIGHT, m_height, EGL_NONE };
+        m_surface = eglCreatePbufferSurface(m_display, config, surface_attribs);
+        const EGLint context_attribs[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 0, EGL_NONE };
+        m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, context_attribs);
+        if (m_surface == EGL_NO_SURFACE or m_context == EGL_NO_CONTEXT
+            or !eglMakeCurrent(m_display, m_surface, m_surface, m_context)) {
+            Log::Fatal("Can't create the GLES3 context");
+            return false;
+        }
+        Log::Info(FMT("Rendering with {}, {}"), (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION));
+        return true;
+    }
+
+    void writeFrame(const std::string& path) {
+        std::vector<unsigned char> pixels(m_width * m_height * 4);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+        // gl rows start at the bottom
+        std::vector<unsigned char> png;
+        if (!Png::encode(pixels.data(), m_width, m_height, 4, png, Png::default_level, true)) {
+            Log::Error(FMT("Can't encode {}"), path);
+            return;
+        }
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            Log::Error(FMT("Can't open {}"), path);
+            return;
+        }
+        if (std::fwrite(png.data(), 1, png.size(), file) != png.size())
+            Log::Error(FMT("Can't write {}"), path);
+        std::fclose(file);
+    }
+
+    void mainloop()
+    {
+        m_io->DeltaTime = m_elapsed_time;
+        m_input.setChangedFlags(m_prev_input);
+
+        ++m_frame;
+        Profiler::begin_frame();
+        if (m_show_gui) {
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui::NewFrame();
+        }
+
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LESS);
+
+        glViewport(0, 0, m_width, m_height);
+        glClearColor(m_clear_color[0], m_clear_color[1], m_clear_color[2], m_clear_color[3]);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        {
+            PROFILE_SCOPE("loop");
+            m_loop_func();
+        }
+
+        if (m_show_gui) {
+            PROFILE_SCOPE("imgui");
+            ImGui::Render();
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
+        Profiler::end_frame();
+        m_prev_input = m_input;
+        m_input.mouseWheel = 0;
+    }
+}
+
+// NAT_SIZE:   WIDTHxHEIGHT of the frames, 1280x720 by default
+// NAT_FRAMES: number of frames to render, 1 by default
+// NAT_OUTPUT: a .png file for the last frame, or a prefix for one numbered png per frame
+// NAT_GUI:    1 to draw the gui too
+// NAT_LOG:    a file to record the log to, see log_format.hpp
+void init(std::function<void()> func)
+{
+    m_loop_func = std::move(func);
+
+    if (const char* size = std::getenv("NAT_SIZE"))
+        std::sscanf(size, "%dx%d", &m_width, &m_height);
+    m_frames = envInt("NAT_FRAMES", m_frames);
+    m_show_gui = envInt("NAT_GUI", m_show_gui);
+    if (const char* output = std::getenv("NAT_OUTPUT"))
+        m_output = output;
+    if (const char* log = std::getenv("NAT_LOG"))
+        Log::start_recording(log);
+
+    if (!createContext()) {
+        m_quit = true;
+        return;
+    }
+
+    IMGUI_CHECKVERSION();
+    ImGui::CreateContext();
+    m_io = &ImGui::GetIO();
+    ImGui_ImplOpenGL3_Init();
+    ImGui::StyleColorsDark();
+    m_io->DisplaySize = ImVec2((float)m_width, (float)m_height);
+    m_io->DisplayFramebufferScale = ImVec2(1, 1);
+    m_io->IniFilename = nullptr;
+
+    m_input.width = m_width;
+    m_input.height = m_height;
+}
+
+void start() {
+    if (m_quit)
+        return;
+    bool single_file = m_output.size() > 4 and m_output.compare(m_output.size() - 4, 4, ".png") == 0;
+
+    // every frame is drawn, the point is to measure them. writing them is timed apart
+    auto since = std::chrono::steady_clock::now();
+    auto lap = [&since] {
+        const auto now = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(now - since).count();
+        since = now;
+        return seconds;
+    };
+    double rendering = 0., writing = 0.;
+    int frames = 0; // fewer than m_frames if the app quits
+    for (; frames < m_frames and not m_quit; ++frames) {
+        mainloop();
+        if (!m_output.empty() and !single_file) {
+            glFinish();
+            rendering += lap();
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04d", frames);
+            writeFrame(m_output + number + ".png");
+            writing += lap();
+        }
+    }
+    glFinish();
+    rendering += lap();
+    std::printf("%d frames in %.3fs, %.3f ms/frame\n", frames, rendering, 1000. * rendering / std::max(1, frames));
+    if (writing > 0.)
+        std::printf("written in %.3fs, %.3f ms/frame\n", writing, 1000. * writing / std::max(1, frames));
+
+    if (single_file)
+        writeFrame(m_output);
+}
+
+void fini() {
+    if (m_io) {
+        ImGui_ImplOpenGL3_Shutdown();
+        ImGui::DestroyContext();
+        m_io = nullptr;
+    }
+    if (m_display != EGL_NO_DISPLAY) {
+        eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (m_context != EGL_NO_CONTEXT)
+            eglDestroyContext(m_display, m_context);
+        if (m_surface != EGL_NO_SURFACE)
+            eglDestroySurface(m_display, m_surface);
+        eglTerminate(m_display);
+    }
+}
+
+bool& show_gui() {
+    return m_show_gui;
+}
+
+bool& quit() {
+    return m_quit;
+}
+
+bool& on_demand() {
+    return m_on_demand;
+}
+
+void request_frames(int count) {
+    int requested = m_requested_frames.load();
+    while (requested < count and not m_requested_frames.compare_exchange_weak(requested, count));
+}
+
+std::array<float,4>& clear_color() {
+    return m_clear_color;
+}
+
+bool visible(){
+    return true;
+}
+
+double elapsed_time(){
+    return m_elapsed_time;
+}
+
+unsigned long frame() {
+    return m_frame;
+}
+
+Input& input(){
+    return m_input;
+}
+
+void setOpenHovered(bool) {
+}
+}
@@ -0,0 +1,306 @@
+// decodes and filters the binary logs recorded by Log::start_recording(), see log_format.hpp
+//
+// natlog [-l LEVELS] [-g TEXT] [-s] FILE
+//   -l LEVELS  only the lines of these levels, comma separated: fatal,error,warn,info,status,debug,trace
+//   -g TEXT    only the lines containing TEXT, case sensitive
+//   -s         counts of lines per level and per format string, instead of the lines
+#include "log.hpp"
+#include "log_format.hpp"
+#include "utils.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+    struct Options {
+        uint8_t levels = 0x7f;
+        std::string grep;
+        bool stats = false;
+        const char* path = nullptr;
+    };
+
+    struct Template {
+        std::string_view format;
+        uint64_t count = 0;
+    };
+
+    bool parseLevels(const char* list, uint8_t& levels) {
+        levels = 0;
+        std::string_view rest = list;
+        while (!rest.empty()) {
+            auto comma = rest.find(',');
+            auto name = rest.substr(0, comma);
+            rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+            bool found = false;
+            for (int i = 0; i < 7; ++i) {
+                std::string_view level = LogFormat::level_names[i];
+                if (level.size() == name.size() and std::equal(level.begin(), level.end(), name.begin(),
+                        [](char a, char b) { return std::tolower((unsigned char)a) == std::tolower((unsigned char)b); })) {
+                    levels |= 1 << i;
+                    found = true;
+                }
+            }
+            if (!found) {
+                std::fprintf(stderr, "unknown level: %.*s\n", (int)name.size(), name.data());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parseOptions(int argc, char** argv, Options& options) {
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            if (arg == "-l" and i + 1 < argc) {
+                if (!parseLevels(argv[++i], options.levels))
+                    return false;
+            } else if (arg == "-g" and i + 1 < argc) {
+                options.grep = argv[++i];
+            } else if (arg == "-s") {
+                options.stats = true;
+            } else if (arg[0] != '-' and !options.path) {
+                options.path = argv[i];
+            } else {
+                return false;
+            }
+        }
+        return options.path != nullptr;
+    }
+
+    // a parameter turned into text, numbers go to the buffer
+    struct Param {
+        char buffer[32];
+        std::string_view text;
+    };
+
+    class Reader {
+    public:
+        Reader(const char* data, size_t size) : m_p(data), m_end(data + size) {}
+
+        bool done() const { return m_p == m_end; }
+        const char* position() const { return m_p; }
+
+        bool byte(uint8_t& v) {
+            if (m_p == m_end)
+                return false;
+            v = *m_p++;
+            return true;
+        }
+        bool varint(uint64_t& v) { return LogFormat::getVarint(m_p, m_end, v); }
+        bool bytes(uint64_t length, std::string_view& v) {
+            if ((uint64_t)(m_end - m_p) < length)
+                return false;
+            v = std::string_view(m_p, length);
+            m_p += length;
+            return true;
+        }
+    private:
+        const char* m_p;
+        const char* m_end;
+    };
+
+    // false if the data is cut or corrupted
+    bool readParam(Reader& in, Param& param) {
+        using Arg = Log::detail::Arg;
+        uint8_t type;
+        uint64_t v;
+        if (!in.byte(type))
+            return false;
+        switch (type) {
+            case Arg::Int:
+                if (!in.varint(v))
+                    return false;
+                param.text = std::string_view(param.buffer, std::snprintf(param.buffer, sizeof(param.buffer), "%" PRId64, LogFormat::unzigzag(v)));
+                return true;
+            case Arg::UInt:
+                if (!in.varint(v))
+                    return false;
+                param.text = std::string_view(param.buffer, std::snprintf(param.buffer, sizeof(param.buffer), "%" PRIu64, v));
+                return true;
+            case Arg::Float: {
+                std::string_view bytes;
+                double f;
+                if (!in.bytes(sizeof(f), bytes))
+                    return false;
+                std::memcpy(&f, bytes.data(), sizeof(f));
+                param.text = std::string_view(param.buffer, std::snprintf(param.buffer, sizeof(param.buffer), "%g", f));
+                return true;
+            }
+            case Arg::Char: {
+                uint8_t c;
+                if (!in.byte(c))
+                    return false;
+                param.buffer[0] = c;
+                param.text = std::string_view(param.buffer, 1);
+                return true;
+            }
+            case Arg::Bool: {
+                uint8_t b;
+                if (!in.byte(b))
+                    return false;
+                param.text = b ? "true" : "false";
+                return true;
+            }
+            case Arg::String:
+                return in.varint(v) and in.bytes(v, param.text);
+        }
+        return false;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::fprintf(stderr, "usage: natlog [-l LEVELS] [-g TEXT] [-s] FILE\n");
+        return 2;
+    }
+
+    // mapped rather than read, so that a big log starts printing right away
+    auto fd = open(options.path, O_RDONLY);
+    if (fd == -1) {
+        std::fprintf(stderr, "can't open %s\n", options.path);
+        return 1;
+    }
+    auto close_fd = on_scope_end([&]() { close(fd); });
+    struct stat st;
+    if (fstat(fd, &st) != 0 or st.st_size < (off_t)sizeof(LogFormat::magic)) {
+        std::fprintf(stderr, "%s is not a log\n", options.path);
+        return 1;
+    }
+    auto data = (const char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        std::fprintf(stderr, "mmap failed\n");
+        return 1;
+    }
+    auto unmap = on_scope_end([&]{ munmap((void*)data, st.st_size); });
+    madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+    if (std::memcmp(data, LogFormat::magic, sizeof(LogFormat::magic)) != 0) {
+        std::fprintf(stderr, "%s is not a log\n", options.path);
+        return 1;
+    }
+
+    static char out_buffer[1 << 16];
+    std::setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    Reader in(data + sizeof(LogFormat::magic), st.st_size - sizeof(LogFormat::magic));
+    std::vector<Template> templates(1); // 0 is for plain lines
+    std::vector<Param> params;
+    std::string text;
+    uint64_t timestamp = 0;
+    uint64_t level_counts[7] = {};
+    uint64_t lost = 0;
+    bool corrupted = false;
+    while (!in.done()) {
+        uint8_t record;
+        if (!in.byte(record)) {
+            corrupted = true;
+            break;
+        }
+        if (record == LogFormat::Template) {
+            uint64_t id, length;
+            std::string_view format;
+            if (!in.varint(id) or id != templates.size() or !in.varint(length) or !in.bytes(length, format)) {
+                corrupted = true;
+                break;
+            }
+            templates.push_back({ format, 0 });
+            continue;
+        }
+        if (record == LogFormat::Gap) {
+            uint64_t count;
+            if (!in.varint(count)) {
+                corrupted = true;
+                break;
+            }
+            // whatever the filters, the lines missing could have matched them
+            lost += count;
+            if (!options.stats)
+                std::printf("-- %" PRIu64 " lines lost before they could be recorded --\n", count);
+            continue;
+        }
+        uint64_t delta, id;
+        uint8_t level;
+        if (record != LogFormat::Line or !in.varint(delta) or !in.byte(level) or level >= 7
+            or !in.varint(id) or id >= templates.size()) {
+            corrupted = true;
+            break;
+        }
+        timestamp += LogFormat::unzigzag(delta);
+
+        std::string_view line;
+        if (id == 0) {
+            uint64_t length;
+            if (!in.varint(length) or !in.bytes(length, line)) {
+                corrupted = true;
+                break;
+            }
+        } else {
+            uint8_t count;
+            if (!in.byte(count)) {
+                corrupted = true;
+                break;
+            }
+            params.resize(count);
+            for (auto& p : params)
+                corrupted = corrupted or !readParam(in, p);
+            if (corrupted)
+                break;
+        }
+        if (!(options.levels & (1 << level)))
+            continue;
+        // the text is only made for the lines that need it
+        if (id != 0 and (!options.stats or !options.grep.empty())) {
+            text.clear();
+            try {
+                detail::format_parse(detail::StringView(templates[id].format.data(), templates[id].format.data() + templates[id].format.size()), params.size(),
+                    [&](const char* begin, const char* end) { text.append(begin, end); },
+                    [&](size_t index) { text.append(params[index].text.data(), params[index].text.size()); });
+            } catch (const std::exception& e) {
+                text = e.what();
+            }
+            line = text;
+        }
+        if (!options.grep.empty() and line.find(options.grep) == std::string_view::npos)
+            continue;
+
+        if (options.stats) {
+            ++level_counts[level];
+            ++templates[id].count;
+            continue;
+        }
+        std::printf("%02" PRIu64 ":%02" PRIu64 ":%02" PRIu64 ".%03" PRIu64 " %-6s | %.*s\n",
+                    timestamp / (60 * 60 * 1000), (timestamp / (60 * 1000)) % 60, (timestamp / 1000) % 60, timestamp % 1000,
+                    LogFormat::level_names[level], (int)line.size(), line.data());
+    }
+
+    if (options.stats) {
+        for (int i = 0; i < 7; ++i)
+            if (level_counts[i])
+                std::printf("%-6s %" PRIu64 "\n", LogFormat::level_names[i], level_counts[i]);
+        if (lost)
+            std::printf("lost   %" PRIu64 "\n", lost);
+        std::sort(templates.begin() + 1, templates.end(), [](const Template& a, const Template& b) { return a.count > b.count; });
+        std::printf("\n");
+        std::printf("%10" PRIu64 "  (plain lines)\n", templates[0].count);
+        for (size_t i = 1; i < templates.size() and templates[i].count; ++i)
+            std::printf("%10" PRIu64 "  %.*s\n", templates[i].count, (int)templates[i].format.size(), templates[i].format.data());
+    }
+    std::fflush(stdout);
+    if (corrupted) {
+        std::fprintf(stderr, "%s is cut or corrupted, stopped at byte %zu\n", options.path, (size_t)(in.position() - data));
+        return 1;
+    }
+    return 0;
+}
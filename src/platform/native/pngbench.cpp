@@ -0,0 +1,113 @@
+// compares Png::encode with stb_image_write on label maps of the sizes the paint window offers, and checks that
+// stb_image decodes them back to the same pixels
+//
+// pngbench [-r RUNS] [-c CHANNELS]
+//   -r RUNS      encodes of each image, the fastest is kept. 5 by default
+//   -c CHANNELS  of the images, 1 like the exported labels by default
+#include "png.hpp"
+#include "thread_pool.hpp"
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#include "stb/stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STBI_WRITE_NO_STDIO
+#include "stb/stb_image_write.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+namespace {
+    // strokes of a few labels over an unlabelled background, like after a painting session
+    std::vector<unsigned char> labelMap(int size, int channels) {
+        std::vector<unsigned char> pixels((size_t)size * size * channels, 0);
+        unsigned seed = 1;
+        auto random = [&] { seed = seed * 1103515245 + 12345; return (seed >> 16) & 0x7fff; };
+        for (int stroke = 0; stroke < 40; ++stroke) {
+            const int label = 1 + random() % 6;
+            const float radius = size * (0.005f + 0.03f * (random() % 100) / 100.f);
+            float x = random() % size, y = random() % size;
+            const float angle = random() % 628 / 100.f;
+            for (int step = 0; step < 50; ++step) {
+                x += std::cos(angle + step * 0.05f) * radius * 0.5f;
+                y += std::sin(angle + step * 0.05f) * radius * 0.5f;
+                const int x0 = std::max(0, (int)(x - radius)), x1 = std::min(size - 1, (int)(x + radius));
+                const int y0 = std::max(0, (int)(y - radius)), y1 = std::min(size - 1, (int)(y + radius));
+                for (int py = y0; py <= y1; ++py)
+                    for (int px = x0; px <= x1; ++px)
+                        if ((px - x) * (px - x) + (py - y) * (py - y) <= radius * radius)
+                            std::memset(&pixels[((size_t)py * size + px) * channels], label, channels);
+            }
+        }
+        return pixels;
+    }
+
+    double fastest(int runs, const std::function<void()>& encode) {
+        double best = 1e30;
+        for (int i = 0; i < runs; ++i) {
+            const auto start = std::chrono::steady_clock::now();
+            encode();
+            best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+
+    bool decodes(const std::vector<unsigned char>& png, const std::vector<unsigned char>& pixels, int size, int channels) {
+        int w, h, c;
+        unsigned char* decoded = stbi_load_from_memory(png.data(), png.size(), &w, &h, &c, channels);
+        const bool same = decoded and w == size and h == size and std::memcmp(decoded, pixels.data(), pixels.size()) == 0;
+        stbi_image_free(decoded);
+        return same;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int runs = 5;
+    int channels = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-r") == 0 and i + 1 < argc)
+            runs = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "-c") == 0 and i + 1 < argc)
+            channels = std::atoi(argv[++i]);
+        else {
+            std::fprintf(stderr, "usage: pngbench [-r RUNS] [-c CHANNELS]\n");
+            return 2;
+        }
+    }
+    if (channels < 1 or channels > 4) {
+        std::fprintf(stderr, "1 to 4 channels\n");
+        return 2;
+    }
+
+    std::printf("%d threads, %d channels, fastest of %d runs\n", ThreadPool::global().size() + 1, channels, runs);
+    std::printf("%6s %-8s %10s %12s %s\n", "size", "encoder", "ms", "bytes", "decodes");
+    bool ok = true;
+    for (int size = 128; size <= 4096; size *= 2) {
+        const auto pixels = labelMap(size, channels);
+        std::vector<unsigned char> png;
+        const double stb = fastest(runs, [&] {
+            png.clear();
+            stbi_write_png_to_func([](void* context, void* data, int size) {
+                auto& png = *(std::vector<unsigned char>*)context;
+                png.insert(png.end(), (unsigned char*)data, (unsigned char*)data + size);
+            }, &png, size, size, channels, pixels.data(), size * channels);
+        });
+        std::printf("%6d %-8s %10.2f %12zu %s\n", size, "stb", stb, png.size(), decodes(png, pixels, size, channels) ? "yes" : "NO");
+        for (int level : { 0, 1, Png::default_level, 6, 9 }) {
+            const double ms = fastest(runs, [&] { Png::encode(pixels.data(), size, size, channels, png, level); });
+            const bool same = decodes(png, pixels, size, channels);
+            ok = ok and same;
+            char name[16];
+            std::snprintf(name, sizeof(name), "level %d", level);
+            std::printf("%6d %-8s %10.2f %12zu %s (x%.1f)\n", size, name, ms, png.size(), same ? "yes" : "NO", stb / ms);
+        }
+    }
+    return ok ? 0 : 1;
+}
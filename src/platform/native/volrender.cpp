@@ -0,0 +1,162 @@
+// renders a volume to a png with CpuRaymarcher, without a gpu nor a display: for thumbnails in batches, and as the
+// reference the gpu renderer is checked against
+//
+// volrender [-s WIDTHxHEIGHT] [-q QUALITY] [-a AZIMUTH] [-e ELEVATION] [-d DISTANCE] [-o OUTPUT] [-c] [VOLUME]
+//   VOLUME          a file VolumeLoader reads, Volume's gradient test volume if none
+//   -s WIDTHxHEIGHT of the image, 512x512 by default
+//   -q QUALITY      samples per voxel crossed, like Volume's quality. 1 by default
+//   -a AZIMUTH      angle of the view around the vertical axis, in degrees. 30 by default
+//   -e ELEVATION    angle of the view above the volume, in degrees. 20 by default
+//   -d DISTANCE     from the camera to the centre of the volume, whose largest side is 2. 3 by default
+//   -o OUTPUT       the png, volume.png by default
+//   -c              also renders the view on the gpu, with the native engine's EGL context, and compares both.
+//                   fails if they differ by more than max_mean_difference on average
+#include "cpu_raymarcher.hpp"
+#include "engine.hpp"
+#include "png.hpp"
+#include "volume.hpp"
+#include "volume_loader.hpp"
+
+#include <glm/gtc/quaternion.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+    // in levels of 255, over all the channels. they differ by rounding and by the gpu's filtering precision
+    const double max_mean_difference = 1.0;
+
+    struct Voxels {
+        std::vector<unsigned char> data;
+        glm::ivec3 size = glm::ivec3(64);
+        int channels = 4;
+        GLenum type = GL_UNSIGNED_BYTE;
+        glm::vec3 spacing = glm::vec3(1.f);
+    };
+
+    bool write(const std::string& path, const std::vector<unsigned char>& png) {
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+        const bool ok = std::fwrite(png.data(), 1, png.size(), file) == png.size();
+        return std::fclose(file) == 0 and ok;
+    }
+
+    // the same view rendered by Volume, in RayBox mode which CpuRaymarcher mirrors
+    bool matchesGpu(const Voxels& voxels, const Camera& cam, float quality, const std::vector<unsigned char>& cpu) {
+        const auto& v = cam.viewport();
+        char size[32];
+        std::snprintf(size, sizeof(size), "%dx%d", v.width, v.height);
+        setenv("NAT_SIZE", size, 1);
+        setenv("NAT_FRAMES", "1", 1);
+        std::vector<unsigned char> gpu;
+        Engine::init([&] {
+            Volume volume(voxels.data.data(), voxels.size, voxels.channels, voxels.type, voxels.spacing);
+            volume.set_render_mode(Volume::RayBox);
+            volume.set_quality(quality);
+            volume.set_interactive(false);
+            glViewport(0, 0, v.width, v.height);
+            volume.render(cam);
+            gpu.resize(cpu.size());
+            glPixelStorei(GL_PACK_ALIGNMENT, 1);
+            glReadPixels(0, 0, v.width, v.height, GL_RGBA, GL_UNSIGNED_BYTE, gpu.data());
+        });
+        Engine::clear_color() = { 0.f, 0.f, 0.f, 0.f };
+        Engine::start();
+        Engine::fini();
+        if (gpu.size() != cpu.size()) {
+            std::fprintf(stderr, "no frame from the gpu\n");
+            return false;
+        }
+
+        double sum = 0.;
+        int largest = 0;
+        for (size_t i = 0; i < cpu.size(); ++i) {
+            const int d = std::abs(cpu[i] - gpu[i]);
+            sum += d;
+            largest = std::max(largest, d);
+        }
+        const double mean = sum / cpu.size();
+        std::printf("gpu: mean difference %.3f, largest %d, of 255\n", mean, largest);
+        return mean <= max_mean_difference;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int width = 512, height = 512;
+    float quality = 1.f;
+    float azimuth = 30.f, elevation = 20.f, distance = 3.f;
+    std::string output = "volume.png";
+    bool check = false;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        auto option = [&](const char* name) { return std::strcmp(argv[i], name) == 0 and i + 1 < argc; };
+        if (option("-s") and std::sscanf(argv[i + 1], "%dx%d", &width, &height) == 2)
+            ++i;
+        else if (option("-q"))
+            quality = std::atof(argv[++i]);
+        else if (option("-a"))
+            azimuth = std::atof(argv[++i]);
+        else if (option("-e"))
+            elevation = std::atof(argv[++i]);
+        else if (option("-d"))
+            distance = std::atof(argv[++i]);
+        else if (option("-o"))
+            output = argv[++i];
+        else if (std::strcmp(argv[i], "-c") == 0)
+            check = true;
+        else if (argv[i][0] != '-' and !path)
+            path = argv[i];
+        else {
+            std::fprintf(stderr, "usage: volrender [-s WIDTHxHEIGHT] [-q QUALITY] [-a AZIMUTH] [-e ELEVATION] [-d DISTANCE] [-o OUTPUT] [-c] [VOLUME]\n");
+            return 2;
+        }
+    }
+    if (width <= 0 or height <= 0 or quality <= 0.f) {
+        std::fprintf(stderr, "the size and the quality must be positive\n");
+        return 2;
+    }
+
+    Voxels voxels;
+    if (path) {
+        VolumeLoader::Header header;
+        if (!VolumeLoader::read(path, header, voxels.type, voxels.data))
+            return 1;
+        voxels.size = header.size;
+        voxels.channels = header.channels;
+        voxels.spacing = header.spacing;
+    } else {
+        voxels.data = Volume::gradient(voxels.size, voxels.channels);
+    }
+
+    // looking at the centre of the volume
+    Camera cam;
+    cam.set_viewport({ 0, 0, width, height });
+    const glm::quat rotation = glm::angleAxis(glm::radians(azimuth), glm::vec3(0, 1, 0))
+                             * glm::angleAxis(glm::radians(-elevation), glm::vec3(1, 0, 0));
+    cam.set_rotation(rotation);
+    cam.set_position(rotation * glm::vec3(0, 0, distance));
+
+    const CpuRaymarcher cpu(voxels.data.data(), voxels.size, voxels.channels, voxels.type, voxels.spacing);
+    std::vector<unsigned char> pixels;
+    const auto start = std::chrono::steady_clock::now();
+    cpu.render(cam, pixels, quality);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // rows from the bottom, like glReadPixels
+    std::vector<unsigned char> png;
+    if (!Png::encode(pixels.data(), width, height, 4, png, Png::default_level, true) or !write(output, png)) {
+        std::fprintf(stderr, "can't write %s\n", output.c_str());
+        return 1;
+    }
+    std::printf("%dx%dx%d voxels, %s, rendered at %dx%d in %.1f ms to %s\n", voxels.size.x, voxels.size.y, voxels.size.z,
+                voxels.type == GL_HALF_FLOAT ? "half floats" : "8 bits", width, height, ms, output.c_str());
+    if (check and !matchesGpu(voxels, cam, quality, pixels))
+        return 1;
+    return 0;
+}
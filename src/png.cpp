@@ -0,0 +1,425 @@
+#include "png.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+    const size_t band_bytes = 256 * 1024; // of filtered rows deflated together, a band is at least a row
+    const int window = 32768;
+    const int hash_bits = 15;
+    const int min_match = 3;
+    const int max_match = 258;
+    const int chain_lengths[] = { 0, 1, 2, 4, 8, 16, 32, 64, 128, 256 }; // candidates tried per match, by level
+
+    struct Code {
+        uint32_t bits; // reversed, as deflate writes huffman codes from the top bit
+        int length;
+    };
+
+    uint32_t reversed(uint32_t code, int length) {
+        uint32_t res = 0;
+        for (int i = 0; i < length; ++i)
+            res |= ((code >> i) & 1) << (length - 1 - i);
+        return res;
+    }
+
+    // the fixed huffman codes of deflate. the length codes include their extra bits, which come right after
+    struct Tables {
+        std::array<Code, 257> literals;        // and the end of block
+        std::array<Code, max_match + 1> lengths;
+        std::array<uint32_t, 4 * 256> crc;    // slice by 4
+
+        Tables() {
+            for (int i = 0; i < 257; ++i) {
+                if (i < 144)
+                    literals[i] = { reversed(0x30 + i, 8), 8 };
+                else if (i < 256)
+                    literals[i] = { reversed(0x190 + i - 144, 9), 9 };
+                else
+                    literals[i] = { 0, 7 };
+            }
+            static const int bases[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+            for (int i = 0; i < 29; ++i) {
+                const int symbol = 257 + i;
+                const Code code = symbol < 280 ? Code{ reversed(symbol - 256, 7), 7 } : Code{ reversed(0xc0 + symbol - 280, 8), 8 };
+                const int extra = i < 8 or i == 28 ? 0 : (i - 4) / 4;
+                for (int l = bases[i]; l < bases[i] + (1 << extra) and l <= max_match; ++l)
+                    lengths[l] = { code.bits | (uint32_t)(l - bases[i]) << code.length, code.length + extra };
+            }
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                crc[i] = c;
+            }
+            for (int i = 0; i < 256; ++i)
+                for (int s = 1; s < 4; ++s)
+                    crc[s * 256 + i] = (crc[(s - 1) * 256 + i] >> 8) ^ crc[crc[(s - 1) * 256 + i] & 0xff];
+        }
+    };
+
+    const Tables& tables() {
+        static const Tables t;
+        return t;
+    }
+
+    // distances have 5 bits codes followed by up to 13 extra bits
+    Code distanceCode(int distance) {
+        const uint32_t v = distance - 1;
+        if (v < 4)
+            return { reversed(v, 5), 5 };
+        const int top = 31 - __builtin_clz(v);
+        const int extra = top - 1;
+        const uint32_t symbol = 2 * top + ((v >> extra) & 1);
+        return { reversed(symbol, 5) | (v & ((1u << extra) - 1)) << 5, 5 + extra };
+    }
+
+    uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0) {
+        const auto& t = tables().crc;
+        crc = ~crc;
+        for (; size >= 4; size -= 4, data += 4) {
+            crc ^= data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+            crc = t[768 + (crc & 0xff)] ^ t[512 + ((crc >> 8) & 0xff)] ^ t[256 + ((crc >> 16) & 0xff)] ^ t[crc >> 24];
+        }
+        for (; size; --size, ++data)
+            crc = t[(crc ^ *data) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    const uint32_t adler_base = 65521;
+
+    uint32_t adler32(const unsigned char* data, size_t size) {
+        uint32_t a = 1, b = 0;
+        while (size) {
+            // the most bytes before the sums can overflow
+            const size_t n = std::min<size_t>(size, 5552);
+            for (size_t i = 0; i < n; ++i) {
+                a += data[i];
+                b += a;
+            }
+            a %= adler_base;
+            b %= adler_base;
+            data += n;
+            size -= n;
+        }
+        return b << 16 | a;
+    }
+
+    // of the concatenation of two parts, from their checksums, like zlib's adler32_combine
+    uint32_t adler32Combine(uint32_t first, uint32_t second, size_t second_size) {
+        const uint32_t rem = second_size % adler_base;
+        uint32_t a = first & 0xffff;
+        uint32_t b = (uint32_t)(((uint64_t)rem * a) % adler_base);
+        a += (second & 0xffff) + adler_base - 1;
+        b += (first >> 16) + (second >> 16) + adler_base - rem;
+        if (a >= adler_base) a -= adler_base;
+        if (a >= adler_base) a -= adler_base;
+        if (b >= 2 * adler_base) b -= 2 * adler_base;
+        if (b >= adler_base) b -= adler_base;
+        return b << 16 | a;
+    }
+
+    void putBig32(unsigned char* out, uint32_t v) {
+        out[0] = v >> 24;
+        out[1] = v >> 16;
+        out[2] = v >> 8;
+        out[3] = v;
+    }
+
+    // the filters of one row, from the left (a), up (b) and up left (c) bytes. the loops are kept simple so that
+    // they are vectorized
+    template<typename Predict>
+    void filter(const unsigned char* row, const unsigned char* up, int size, int bpp, unsigned char* out, const Predict& predict) {
+        for (int i = 0; i < bpp; ++i)
+            out[i] = row[i] - predict(0, up[i], 0);
+        for (int i = bpp; i < size; ++i)
+            out[i] = row[i] - predict(row[i - bpp], up[i], up[i - bpp]);
+    }
+
+    // libpng's heuristic: the smallest sum of the bytes taken as signed
+    unsigned cost(const unsigned char* filtered, int size) {
+        unsigned sum = 0;
+        for (int i = 0; i < size; ++i)
+            sum += std::abs((int)(signed char)filtered[i]);
+        return sum;
+    }
+
+    void filterRow(const unsigned char* row, const unsigned char* up, int size, int bpp, unsigned char* out, unsigned char* scratch) {
+        const auto none = [](int, int, int) { return 0; };
+        const auto sub = [](int a, int, int) { return a; };
+        const auto upper = [](int, int b, int) { return b; };
+        const auto average = [](int a, int b, int) { return (a + b) >> 1; };
+        const auto paeth = [](int a, int b, int c) {
+            const int pa = std::abs(b - c);
+            const int pb = std::abs(a - c);
+            const int pc = std::abs(a + b - 2 * c);
+            return pa <= pb and pa <= pc ? a : pb <= pc ? b : c;
+        };
+        filter(row, up, size, bpp, scratch, none);
+        filter(row, up, size, bpp, scratch + size, sub);
+        filter(row, up, size, bpp, scratch + 2 * size, upper);
+        filter(row, up, size, bpp, scratch + 3 * size, average);
+        filter(row, up, size, bpp, scratch + 4 * size, paeth);
+        int best = 0;
+        unsigned best_cost = cost(scratch, size);
+        for (int f = 1; f < 5; ++f) {
+            const unsigned c = cost(scratch + f * size, size);
+            if (c < best_cost) {
+                best = f;
+                best_cost = c;
+            }
+        }
+        out[0] = best;
+        std::memcpy(out + 1, scratch + best * size, size);
+    }
+
+    class BitWriter {
+    public:
+        explicit BitWriter(unsigned char* out) : m_out(out) {}
+
+        void put(uint32_t bits, int count) {
+            m_bits |= (uint64_t)bits << m_count;
+            m_count += count;
+            if (m_count >= 32) {
+                for (int i = 0; i < 4; ++i)
+                    *m_out++ = m_bits >> (8 * i);
+                m_bits >>= 32;
+                m_count -= 32;
+            }
+        }
+        void put(Code code) { put(code.bits, code.length); }
+        // to the next byte
+        void align() {
+            while (m_count > 0) {
+                *m_out++ = m_bits;
+                m_bits >>= 8;
+                m_count -= 8;
+            }
+            m_bits = 0;
+            m_count = 0;
+        }
+        void bytes(const unsigned char* data, size_t size) {
+            std::memcpy(m_out, data, size);
+            m_out += size;
+        }
+        unsigned char* end() const { return m_out; }
+
+    private:
+        unsigned char* m_out;
+        uint64_t m_bits = 0;
+        int m_count = 0;
+    };
+
+    int matchLength(const unsigned char* a, const unsigned char* b, int limit) {
+        int n = 0;
+        for (; n + 8 <= limit; n += 8) {
+            uint64_t x, y;
+            std::memcpy(&x, a + n, 8);
+            std::memcpy(&y, b + n, 8);
+            if (x != y) // little endian, the first different byte is in the low bits
+                return n + __builtin_ctzll(x ^ y) / 8;
+        }
+        while (n < limit and a[n] == b[n])
+            ++n;
+        return n;
+    }
+
+    uint32_t hash(const unsigned char* p) {
+        const uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+
+    size_t storedSize(size_t size) {
+        return size + (size / 65535 + 1) * 5;
+    }
+
+    // the most a band takes before falling back to stored, 9 bits per byte at worst with the fixed codes
+    size_t deflateBound(size_t size) {
+        return storedSize(size) + size / 8 + 16;
+    }
+
+    void stored(const unsigned char* data, size_t size, bool last, BitWriter& out) {
+        do {
+            const size_t n = std::min<size_t>(size, 65535);
+            size -= n;
+            out.put(last and size == 0, 3);
+            out.align();
+            const unsigned char header[] = { (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)~n, (unsigned char)(~n >> 8) };
+            out.bytes(header, 4);
+            out.bytes(data, n);
+            data += n;
+        } while (size);
+    }
+
+    // [begin, end) of data as fixed huffman blocks, matches reaching back to the previous bands. a band that doesn't
+    // compress is stored. bands end on a byte so that they can be concatenated, the last one ends the stream
+    unsigned char* deflateBand(const unsigned char* data, size_t begin, size_t end, int level, bool last, unsigned char* out) {
+        BitWriter bits(out);
+        if (level == 0) {
+            stored(data + begin, end - begin, last, bits);
+            return bits.end();
+        }
+        const auto& t = tables();
+        const int chain_length = chain_lengths[std::min(level, 9)];
+        std::vector<int> head(1 << hash_bits, -1);
+        std::vector<int> chain(window);
+        auto insert = [&](size_t i) {
+            int& h = head[hash(data + i)];
+            chain[i % window] = h;
+            h = i;
+        };
+        for (size_t i = begin - std::min<size_t>(begin, window); i < begin; ++i)
+            insert(i);
+
+        bits.put(last, 1);
+        bits.put(1, 2);
+        for (size_t i = begin; i < end;) {
+            const int limit = std::min<size_t>(max_match, end - i);
+            int best = 0;
+            int distance = 0;
+            if (limit >= min_match) {
+                int probes = chain_length;
+                for (int candidate = head[hash(data + i)]; candidate >= 0 and i - candidate <= window and probes--;) {
+                    if (data[candidate + best] == data[i + best]) {
+                        const int length = matchLength(data + candidate, data + i, limit);
+                        if (length > best) {
+                            best = length;
+                            distance = i - candidate;
+                            if (length == limit)
+                                break;
+                        }
+                    }
+                    const int next = chain[candidate % window];
+                    if (next >= candidate) // overwritten by a newer position
+                        break;
+                    candidate = next;
+                }
+                insert(i);
+            }
+            if (best >= min_match) {
+                bits.put(t.lengths[best]);
+                bits.put(distanceCode(distance));
+                // faster levels only find matches from where the previous one started
+                if (level > 1)
+                    for (size_t j = i + 1; j < i + best and j + min_match <= end; ++j)
+                        insert(j);
+                i += best;
+            } else {
+                bits.put(t.literals[data[i]]);
+                ++i;
+            }
+        }
+        bits.put(t.literals[256]);
+        if (!last) {
+            // an empty stored block, to end on a byte
+            bits.put(0, 3);
+            bits.align();
+            const unsigned char empty[] = { 0, 0, 0xff, 0xff };
+            bits.bytes(empty, 4);
+        }
+        bits.align();
+        if ((size_t)(bits.end() - out) > storedSize(end - begin)) {
+            BitWriter again(out);
+            stored(data + begin, end - begin, last, again);
+            return again.end();
+        }
+        return bits.end();
+    }
+
+    void putChunk(std::vector<unsigned char>& png, const char* type, const unsigned char* data, size_t size) {
+        unsigned char header[8];
+        putBig32(header, size);
+        std::memcpy(header + 4, type, 4);
+        png.insert(png.end(), header, header + 8);
+        png.insert(png.end(), data, data + size);
+        unsigned char crc[4];
+        putBig32(crc, crc32(data, size, crc32(header + 4, 4)));
+        png.insert(png.end(), crc, crc + 4);
+    }
+}
+
+namespace Png {
+
+bool encode(const unsigned char* pixels, int width, int height, int channels, std::vector<unsigned char>& png, int level, bool flip)
+{
+    if (width <= 0 or height <= 0 or channels < 1 or channels > 4 or level < 0 or level > 9)
+        return false;
+    const size_t row_size = (size_t)width * channels;
+    const size_t stride = row_size + 1; // with the filter byte
+    if (row_size > 0x7fffffff / 2)
+        return false;
+    const int rows_per_band = std::max<size_t>(1, band_bytes / stride);
+    const int bands = (height + rows_per_band - 1) / rows_per_band;
+    auto row = [&](int y) { return pixels + (size_t)(flip ? height - 1 - y : y) * row_size; };
+
+    std::vector<unsigned char> filtered(stride * height);
+    ThreadPool::global().parallel_for(bands, [&](int band) {
+        std::vector<unsigned char> scratch(5 * row_size);
+        const std::vector<unsigned char> zeros(band == 0 ? row_size : 0);
+        for (int y = band * rows_per_band; y < std::min(height, (band + 1) * rows_per_band); ++y) {
+            unsigned char* out = filtered.data() + y * stride;
+            if (level == 0) {
+                out[0] = 0;
+                std::memcpy(out + 1, row(y), row_size);
+            } else {
+                filterRow(row(y), y ? row(y - 1) : zeros.data(), row_size, channels, out, scratch.data());
+            }
+        }
+    });
+
+    // each band is an IDAT chunk, the zlib header starting the first one
+    std::vector<std::vector<unsigned char>> chunks(bands);
+    std::vector<uint32_t> adlers(bands);
+    ThreadPool::global().parallel_for(bands, [&](int band) {
+        const size_t begin = band * rows_per_band * stride;
+        const size_t end = std::min<size_t>(height, (band + 1) * rows_per_band) * stride;
+        auto& chunk = chunks[band];
+        chunk.resize(8 + 2 + deflateBound(end - begin) + 4);
+        unsigned char* out = chunk.data() + 8;
+        if (band == 0) {
+            *out++ = 0x78; // deflate, 32k window
+            *out++ = 0x01; // no dictionary, fastest, and the check bits
+        }
+        out = deflateBand(filtered.data(), begin, end, level, band == bands - 1, out);
+        const size_t size = out - chunk.data() - 8;
+        putBig32(chunk.data(), size);
+        std::memcpy(chunk.data() + 4, "IDAT", 4);
+        putBig32(out, crc32(chunk.data() + 4, size + 4));
+        chunk.resize(8 + size + 4);
+        adlers[band] = adler32(filtered.data() + begin, end - begin);
+    });
+    uint32_t adler = adlers[0];
+    for (int band = 1; band < bands; ++band) {
+        const size_t size = (std::min(height, (band + 1) * rows_per_band) - band * rows_per_band) * stride;
+        adler = adler32Combine(adler, adlers[band], size);
+    }
+
+    size_t total = 8 + (12 + 13) + (12 + 4) + 12;
+    for (const auto& chunk : chunks)
+        total += chunk.size();
+    png.clear();
+    png.reserve(total);
+    const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    png.insert(png.end(), signature, signature + 8);
+    static const unsigned char color_types[] = { 0, 4, 2, 6 };
+    unsigned char header[13] = {};
+    putBig32(header, width);
+    putBig32(header + 4, height);
+    header[8] = 8;
+    header[9] = color_types[channels - 1];
+    putChunk(png, "IHDR", header, 13);
+    for (const auto& chunk : chunks)
+        png.insert(png.end(), chunk.begin(), chunk.end());
+    unsigned char check[4];
+    putBig32(check, adler);
+    putChunk(png, "IDAT", check, 4);
+    putChunk(png, "IEND", nullptr, 0);
+    return true;
+}
+
+}
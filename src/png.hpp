@@ -0,0 +1,15 @@
+#pragma once
+
+#include <vector>
+
+// png files written without stb, which filters and deflates on a single thread one byte at a time.
+// the rows are filtered then deflated in bands on the thread pool, each band in its own IDAT chunk, and the
+// file is assembled in a buffer reserved once
+namespace Png {
+    // 0 stores without compressing, 1 is the fastest and 9 the smallest. stb is about 5
+    const int default_level = 2;
+
+    // 8 bits, 1 to 4 channels (grey, grey alpha, rgb, rgba), rows from the top unless flip. false for bad sizes
+    bool encode(const unsigned char* pixels, int width, int height, int channels, std::vector<unsigned char>& png,
+                int level = default_level, bool flip = false);
+}
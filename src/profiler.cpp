@@ -0,0 +1,354 @@
+#include "profiler.hpp"
+#include "engine.hpp"
+
+#include "imgui/imgui.h"
+
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+namespace Profiler {
+
+namespace detail {
+    bool enabled = false;
+}
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Event {
+        const char* name;
+        int parent;    // index in the frame's events, -1 for the top level
+        int depth;
+        float start;   // ms since the beginning of the frame
+        float cpu;     // ms
+        float gpu;     // ms, children included, negative until the queries are back
+        float gpu_self;
+    };
+
+    struct Frame {
+        uint64_t id = 0;
+        float cpu = 0.f;
+        float gpu = -1.f;
+        int pending = 0; // gpu queries not read back yet
+        bool disjoint = false;
+        std::vector<Event> events; // in the order they began, parents before their children
+    };
+
+    // a few thousand frames, the events vectors keep their capacity so that recording doesn't allocate
+    const size_t frame_capacity = 4096;
+    std::vector<Frame> m_frames;
+    uint64_t m_frame = 0; // id of the last frame begun, ids start at 1
+    bool m_in_frame = false;
+    bool m_paused = false;
+    uint64_t m_selected = 0; // 0 follows the last frame
+    Clock::time_point m_frame_begin;
+    std::vector<int> m_open; // events of the current frame that haven't ended
+
+    // gpu timing, with EXT_disjoint_timer_query(_webgl2). time elapsed queries can't nest,
+    // so one runs for the innermost open event and is restarted whenever that changes
+    enum { Unknown, Unsupported, Supported } m_gpu = Unknown;
+    struct Query {
+        GLuint id;
+        uint64_t frame;
+        int event;
+    };
+    std::vector<GLuint> m_free_queries;
+    std::deque<Query> m_pending_queries; // results come back in the order the queries ended
+    Query m_query = { 0, 0, -1 };
+
+    Frame& frame(uint64_t id) {
+        return m_frames[id % frame_capacity];
+    }
+
+    float msSince(Clock::time_point t) {
+        return std::chrono::duration<float, std::milli>(Clock::now() - t).count();
+    }
+
+    bool gpuTiming() {
+        if (m_gpu == Unknown) {
+            // "GL_EXT_disjoint_timer_query" natively, "GL_EXT_disjoint_timer_query_webgl2" in the browser
+            auto extensions = (const char*)glGetString(GL_EXTENSIONS);
+            m_gpu = extensions and std::strstr(extensions, "_disjoint_timer_query") ? Supported : Unsupported;
+        }
+        return m_gpu == Supported;
+    }
+
+    // ends the running query if any, and starts one for the event
+    void switchQuery(int event) {
+        if (!gpuTiming())
+            return;
+        if (m_query.event >= 0) {
+            glEndQuery(GL_TIME_ELAPSED_EXT);
+            m_pending_queries.push_back(m_query);
+            ++frame(m_query.frame).pending;
+            m_query.event = -1;
+        }
+        if (event >= 0) {
+            if (m_free_queries.empty()) {
+                m_free_queries.emplace_back();
+                glGenQueries(1, &m_free_queries.back());
+            }
+            m_query = { m_free_queries.back(), m_frame, event };
+            m_free_queries.pop_back();
+            glBeginQuery(GL_TIME_ELAPSED_EXT, m_query.id);
+        }
+    }
+
+    // sums the time of the children into their parents, once all the queries of the frame are back
+    void resolveGpu(Frame& f) {
+        f.gpu = 0.f;
+        for (auto& e : f.events)
+            e.gpu = e.gpu_self;
+        for (int i = (int)f.events.size() - 1; i >= 0; --i) {
+            const auto& e = f.events[i];
+            if (e.parent >= 0)
+                f.events[e.parent].gpu += e.gpu;
+            else
+                f.gpu += e.gpu;
+        }
+    }
+
+    void readQueries() {
+        if (m_pending_queries.empty())
+            return;
+        // the results of all the queries in flight are garbage after a disjoint, a gpu reset or a clock change
+        GLint disjoint = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        while (!m_pending_queries.empty()) {
+            const auto q = m_pending_queries.front();
+            GLuint available = 0;
+            glGetQueryObjectuiv(q.id, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+            GLuint ns = 0;
+            glGetQueryObjectuiv(q.id, GL_QUERY_RESULT, &ns);
+            m_pending_queries.pop_front();
+            m_free_queries.push_back(q.id);
+
+            // the frame may have been overwritten since
+            auto& f = frame(q.frame);
+            if (f.id != q.frame)
+                continue;
+            // some drivers (llvmpipe) return a slightly negative time for the very first query, wrapped around
+            f.disjoint = f.disjoint or disjoint or ns >= (1u << 31);
+            f.events[q.event].gpu_self += ns / 1.0e6f;
+            if (--f.pending == 0 and not f.disjoint)
+                resolveGpu(f);
+        }
+        // while the profiler is open the results are worth a frame
+        if (!m_pending_queries.empty())
+            Engine::request_frames();
+    }
+
+    const Frame* selectedFrame() {
+        uint64_t id = m_selected;
+        if (id == 0)
+            id = m_in_frame ? m_frame - 1 : m_frame;
+        if (id == 0 or m_frames.empty() or frame(id).id != id)
+            return nullptr;
+        return &frame(id);
+    }
+
+    ImU32 scopeColor(const char* name) {
+        // stable per name, so that a scope keeps its color from frame to frame
+        uint32_t h = 2166136261u;
+        for (auto c = name; *c; ++c)
+            h = (h ^ (uint8_t)*c) * 16777619u;
+        return ImColor::HSV((h % 360) / 360.f, 0.5f, 0.7f);
+    }
+
+    void drawHistory() {
+        const float height = 60.f;
+        const ImVec2 size(ImGui::GetContentRegionAvail().x, height);
+        const ImVec2 origin = ImGui::GetCursorScreenPos();
+        ImGui::InvisibleButton("history", size);
+        if (size.x <= 0.f)
+            return;
+
+        // one bar per frame, at least 2 pixels wide
+        const uint64_t last = m_in_frame ? m_frame - 1 : m_frame;
+        const uint64_t count = std::min<uint64_t>({ last, frame_capacity, (uint64_t)(size.x / 2) });
+        if (count == 0)
+            return;
+        float longest = 1000.f / 60;
+        for (uint64_t id = last - count + 1; id <= last; ++id)
+            longest = std::max(longest, frame(id).cpu);
+
+        auto draw_list = ImGui::GetWindowDrawList();
+        const float bar = size.x / count;
+        const uint64_t selected = m_selected ? m_selected : last;
+        for (uint64_t i = 0; i < count; ++i) {
+            const auto& f = frame(last - count + 1 + i);
+            const float x = origin.x + i * bar;
+            const float y = origin.y + height * (1.f - f.cpu / longest);
+            ImU32 color = f.id == selected ? IM_COL32(255, 200, 80, 255) : IM_COL32(110, 160, 220, 255);
+            draw_list->AddRectFilled({x, y}, {x + std::max(1.f, bar - 1.f), origin.y + height}, color);
+        }
+        // the budget of a 60Hz display
+        const float budget = origin.y + height * (1.f - 1000.f / 60 / longest);
+        draw_list->AddLine({origin.x, budget}, {origin.x + size.x, budget}, IM_COL32(255, 80, 80, 160));
+
+        if (ImGui::IsItemHovered()) {
+            const uint64_t i = std::min<uint64_t>(count - 1, (ImGui::GetIO().MousePos.x - origin.x) / bar);
+            const auto& f = frame(last - count + 1 + i);
+            if (f.gpu >= 0.f)
+                ImGui::SetTooltip("frame %llu: %.2f ms cpu, %.2f ms gpu", (unsigned long long)f.id, f.cpu, f.gpu);
+            else
+                ImGui::SetTooltip("frame %llu: %.2f ms cpu", (unsigned long long)f.id, f.cpu);
+            if (ImGui::IsMouseClicked(0))
+                m_selected = f.id;
+        }
+    }
+
+    void drawTimeline(const Frame& f) {
+        int depth = 0;
+        for (const auto& e : f.events)
+            depth = std::max(depth, e.depth + 1);
+        const float row = ImGui::GetTextLineHeightWithSpacing();
+        const ImVec2 size(ImGui::GetContentRegionAvail().x, std::max(1, depth) * row);
+        const ImVec2 origin = ImGui::GetCursorScreenPos();
+        ImGui::InvisibleButton("timeline", size);
+        if (size.x <= 0.f or f.cpu <= 0.f)
+            return;
+
+        auto draw_list = ImGui::GetWindowDrawList();
+        const float scale = size.x / f.cpu;
+        const ImVec2 mouse = ImGui::GetIO().MousePos;
+        const Event* hovered = nullptr;
+        for (const auto& e : f.events) {
+            const ImVec2 a(origin.x + e.start * scale, origin.y + e.depth * row);
+            const ImVec2 b(std::max(a.x + 1.f, a.x + e.cpu * scale), a.y + row - 1.f);
+            draw_list->AddRectFilled(a, b, scopeColor(e.name));
+            // the name when it fits, roughly
+            if (b.x - a.x > 8.f * std::strlen(e.name))
+                draw_list->AddText({a.x + 2.f, a.y}, IM_COL32_WHITE, e.name);
+            if (mouse.x >= a.x and mouse.x < b.x and mouse.y >= a.y and mouse.y < b.y)
+                hovered = &e;
+        }
+        if (hovered and ImGui::IsItemHovered()) {
+            if (hovered->gpu >= 0.f)
+                ImGui::SetTooltip("%s\n%.3f ms cpu\n%.3f ms gpu", hovered->name, hovered->cpu, hovered->gpu);
+            else
+                ImGui::SetTooltip("%s\n%.3f ms cpu", hovered->name, hovered->cpu);
+        }
+    }
+}
+
+bool& enabled() {
+    return detail::enabled;
+}
+
+void begin_frame() {
+    readQueries();
+    if (!detail::enabled or m_paused)
+        return;
+    if (m_frames.empty())
+        m_frames.resize(frame_capacity);
+
+    auto& f = frame(++m_frame);
+    f.id = m_frame;
+    f.cpu = 0.f;
+    f.gpu = -1.f;
+    f.pending = 0;
+    f.disjoint = false;
+    f.events.clear();
+    m_open.clear();
+    m_in_frame = true;
+    m_frame_begin = Clock::now();
+}
+
+void end_frame() {
+    if (!m_in_frame)
+        return;
+    // scopes still open, something returned without ending them
+    while (!m_open.empty())
+        detail::end(m_open.back());
+    auto& f = frame(m_frame);
+    f.cpu = msSince(m_frame_begin);
+    m_in_frame = false;
+}
+
+namespace detail {
+    int begin(const char* name) {
+        // enabled in the middle of a frame
+        if (!m_in_frame)
+            return -1;
+        auto& f = frame(m_frame);
+        const int index = f.events.size();
+        const int parent = m_open.empty() ? -1 : m_open.back();
+        f.events.push_back(Event{ name, parent, (int)m_open.size(), msSince(m_frame_begin), 0.f, -1.f, 0.f });
+        m_open.push_back(index);
+        switchQuery(index);
+        return index;
+    }
+
+    void end(int index) {
+        if (!m_in_frame or m_open.empty() or m_open.back() != index)
+            return;
+        auto& e = frame(m_frame).events[index];
+        e.cpu = msSince(m_frame_begin) - e.start;
+        m_open.pop_back();
+        switchQuery(m_open.empty() ? -1 : m_open.back());
+    }
+}
+
+void draw_widget() {
+    auto& in = Engine::input();
+    ImGui::SetNextWindowPos(ImVec2((float)in.width - 10.f, 10.f), ImGuiCond_FirstUseEver, ImVec2(1.f, 0.f));
+    ImGui::SetNextWindowSize(ImVec2((float)in.width / 3.f, 300), ImGuiCond_FirstUseEver);
+    ImGui::Begin("Profiler");
+    ImGui::Checkbox("Record", &detail::enabled);
+    ImGui::SameLine();
+    ImGui::Checkbox("Pause", &m_paused);
+    ImGui::SameLine();
+    if (ImGui::Button("Last frame"))
+        m_selected = 0;
+    if (m_gpu == Unsupported) {
+        ImGui::SameLine();
+        ImGui::TextDisabled("(no gpu timer queries)");
+    }
+    // the widget shows live data
+    if (detail::enabled and not m_paused)
+        Engine::request_frames();
+
+    if (m_frame == 0 or (m_in_frame and m_frame == 1)) {
+        ImGui::Text("No frame recorded");
+        ImGui::End();
+        return;
+    }
+
+    drawHistory();
+    if (const Frame* f = selectedFrame()) {
+        if (f->gpu >= 0.f)
+            ImGui::Text("Frame %llu: %.2f ms cpu, %.2f ms gpu", (unsigned long long)f->id, f->cpu, f->gpu);
+        else
+            ImGui::Text("Frame %llu: %.2f ms cpu", (unsigned long long)f->id, f->cpu);
+        drawTimeline(*f);
+
+        ImGui::Columns(3, "scopes");
+        ImGui::Text("Scope"); ImGui::NextColumn();
+        ImGui::Text("CPU ms"); ImGui::NextColumn();
+        ImGui::Text("GPU ms"); ImGui::NextColumn();
+        ImGui::Separator();
+        for (const auto& e : f->events) {
+            ImGui::Text("%*s%s", 2 * e.depth, "", e.name); ImGui::NextColumn();
+            ImGui::Text("%.3f", e.cpu); ImGui::NextColumn();
+            if (e.gpu >= 0.f)
+                ImGui::Text("%.3f", e.gpu);
+            else
+                ImGui::TextDisabled("-");
+            ImGui::NextColumn();
+        }
+        ImGui::Columns(1);
+    }
+    ImGui::End();
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+namespace Profiler {
+    namespace detail {
+        extern bool enabled;
+        int begin(const char* name);
+        void end(int index);
+    }
+
+    // disabled by default, a disabled scope costs a branch
+    bool& enabled();
+
+    // called by the engine around each drawn frame
+    void begin_frame();
+    void end_frame();
+
+    // times what runs until the end of the enclosing block, on the cpu and when possible the gpu.
+    // the name must outlive the profiler, a string literal typically. main thread only, like the gl calls it measures
+    class Scope {
+    public:
+        explicit Scope(const char* name) : m_index(detail::enabled ? detail::begin(name) : -1) {}
+        ~Scope() { if (m_index >= 0) detail::end(m_index); }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        int m_index;
+    };
+
+    void draw_widget();
+}
+
+#define PROFILER_CONCAT_IMPL(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_IMPL(a, b)
+#define PROFILE_SCOPE(name) Profiler::Scope PROFILER_CONCAT(profile_scope_, __LINE__)(name)
@@ -0,0 +1,138 @@
+#include "readback.hpp"
+#include "engine.hpp"
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __EMSCRIPTEN__
+// webgl2 can't map buffers, it copies them out instead
+extern "C" void glGetBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, void* data);
+#endif
+
+namespace {
+    struct Slot {
+        GLuint buffer = 0;
+        size_t capacity = 0;
+        GLsync fence = 0; // 0 if free
+        unsigned long order = 0;
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        Readback::Done done;
+    };
+    Slot m_slots[2];
+    unsigned long m_order = 0;
+    GLuint m_frame_buffer = 0;
+
+    // waits for the copy if it hasn't arrived yet
+    void complete(Slot& slot)
+    {
+        PROFILE_SCOPE("readback");
+        const size_t count = (size_t)slot.width * slot.height;
+        // rgba is the only format gles3 always reads back, fewer channels are dropped after
+        std::vector<unsigned char> pixels(count * 4);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+#ifdef __EMSCRIPTEN__
+        glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, pixels.size(), pixels.data());
+#else
+        if (const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pixels.size(), GL_MAP_READ_BIT)) {
+            std::memcpy(pixels.data(), mapped, pixels.size());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+#endif
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glDeleteSync(slot.fence);
+        slot.fence = 0;
+        if (slot.channels < 4) {
+            for (size_t i = 0; i < count; ++i)
+                std::copy_n(&pixels[i * 4], slot.channels, &pixels[i * slot.channels]);
+            pixels.resize(count * slot.channels);
+        }
+        // done may start another read
+        auto done = std::move(slot.done);
+        slot.done = nullptr;
+        done(std::move(pixels));
+    }
+
+    // the reads in flight, oldest first
+    std::vector<Slot*> inFlight()
+    {
+        std::vector<Slot*> res;
+        for (auto& slot : m_slots)
+            if (slot.fence)
+                res.push_back(&slot);
+        std::sort(res.begin(), res.end(), [](const Slot* a, const Slot* b) { return a->order < b->order; });
+        return res;
+    }
+}
+
+namespace Readback {
+
+void read(GLuint texture, int width, int height, int channels, Done done)
+{
+    auto free = std::find_if(std::begin(m_slots), std::end(m_slots), [](const Slot& s) { return s.fence == 0; });
+    if (free == std::end(m_slots)) {
+        Slot* oldest = inFlight().front();
+        complete(*oldest);
+        free = oldest;
+    }
+    Slot& slot = *free;
+    if (m_frame_buffer == 0)
+        glGenFramebuffers(1, &m_frame_buffer);
+    if (slot.buffer == 0)
+        glGenBuffers(1, &slot.buffer);
+
+    // may be called while rendering to another target
+    GLint previous_frame_buffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous_frame_buffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_frame_buffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+
+    const size_t size = (size_t)width * height * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    if (slot.capacity < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+        slot.capacity = size;
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_frame_buffer);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // or the fence may never be passed
+    glFlush();
+    slot.order = ++m_order;
+    slot.width = width;
+    slot.height = height;
+    slot.channels = channels;
+    slot.done = std::move(done);
+    Engine::request_frames();
+}
+
+void poll()
+{
+    for (Slot* slot : inFlight()) {
+        // in order, a read isn't done before the ones started earlier
+        const GLenum status = glClientWaitSync(slot->fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED and status != GL_CONDITION_SATISFIED) {
+            Engine::request_frames();
+            return;
+        }
+        complete(*slot);
+    }
+}
+
+void finish()
+{
+    for (Slot* slot : inFlight())
+        complete(*slot);
+}
+
+bool busy()
+{
+    return std::any_of(std::begin(m_slots), std::end(m_slots), [](const Slot& s) { return s.fence != 0; });
+}
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <GLES3/gl3.h>
+#include <functional>
+#include <vector>
+
+// reads textures back without stalling the pipeline: the pixels are copied to a pixel pack buffer, which is only
+// read once its fence has passed, a frame or more later. two reads can be in flight, a third one waits for the oldest.
+// main thread only
+namespace Readback {
+    // in the texture's channels, rows from the bottom
+    using Done = std::function<void(std::vector<unsigned char>&& pixels)>;
+
+    // 8 bits textures of 1 to 4 channels. done is called by poll() or finish()
+    void read(GLuint texture, int width, int height, int channels, Done done);
+    // calls done for the reads that have arrived, from the main loop
+    void poll();
+    // waits for all the reads in flight
+    void finish();
+    bool busy();
+}
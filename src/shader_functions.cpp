@@ -22,7 +22,7 @@ GLuint load_shader(GLenum type, const char *shaderSrc)
         {
             char* infoLog = new char[infoLen];
             glGetShaderInfoLog(shader, infoLen, nullptr, infoLog);
-            Log::Error(std::string("Error compiling shader: ") + infoLog);
+            Log::Error(FMT("Error compiling shader: {}"), infoLog);
             delete[] infoLog;
         }
         glDeleteShader(shader);
@@ -58,7 +58,7 @@ bool create_program(GLuint& prog, const char* vert, const char* frag)
         {
             char* infoLog = new char[infoLen];
             glGetProgramInfoLog(prog, infoLen, nullptr, infoLog);
-            Log::Error(std::string("Error linking program: ") + infoLog);
+            Log::Error(FMT("Error linking program: {}"), infoLog);
             delete[] infoLog;
         }
         glDeleteProgram(prog);
@@ -1,9 +1,16 @@
 #include "textured_quad.hpp"
+#include "accumulator.hpp"
 #include "log.hpp"
+#include "profiler.hpp"
 #include "engine.hpp"
 #include "utils.hpp"
+#include "glUtils.hpp"
+#include "readback.hpp"
 #include "shader_functions.hpp"
 
+#include <algorithm>
+#include <cstddef>
+#include <functional>
 #include <vector>
 #include <cstdio>
 
@@ -36,26 +43,22 @@ GLuint TexturedQuad::verticesBuffer() {
     return Buffers::verticesBuffer;
 }
 
-TexturedQuad::TexturedQuad(const unsigned char* data, int w, int h, int c, bool nearest)
+TexturedQuad::TexturedQuad(const void* data, int w, int h, int c, bool nearest, GLenum type)
     : m_width(w)
     , m_height(h)
     , m_channels(c)
+    , m_type(type)
     , m_ratio((float)w / (float)h)
 {
     Buffers::init();
-    GLenum format = 0;
-    switch (m_channels) {
-        case 1: format = GL_RED; break;
-        case 2: format = GL_RG; break;
-        case 3: format = GL_RGB; break;
-        case 4: format = GL_RGBA; break;
-        default: Log::Error("Invalid channels number"); break;
-    }
+    const GLenum format = GlUtils::format(m_channels);
+    if (!format)
+        Log::Error("Invalid channels number");
     glGenTextures(1, &m_texture);
 
     glBindTexture(GL_TEXTURE_2D, m_texture);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format, GL_UNSIGNED_BYTE, data);
+    glTexImage2D(GL_TEXTURE_2D, 0, GlUtils::internalFormat(c, type), w, h, 0, format, type, data);
 
     if (nearest) {
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -67,41 +70,97 @@ TexturedQuad::TexturedQuad(const unsigned char* data, int w, int h, int c, bool
 }
 
 TexturedQuad::TexturedQuad(int w, int h, int c, bool nearest)
-    : TexturedQuad(0, w, h, c, nearest)
+    : TexturedQuad(nullptr, w, h, c, nearest)
+{}
+
+TexturedQuad::TexturedQuad(std::shared_ptr<const unsigned char> pixels, int w, int h, int c, GLenum type)
+    : TexturedQuad(std::make_unique<TilePyramid>(std::move(pixels), w, h, c, type))
 {}
 
+TexturedQuad::TexturedQuad(std::unique_ptr<TilePyramid> tiles)
+    : m_width(tiles->width())
+    , m_height(tiles->height())
+    , m_channels(tiles->channels())
+    , m_type(tiles->type())
+    , m_ratio((float)m_width / (float)m_height)
+    , m_tiles(std::move(tiles))
+{
+    Buffers::init();
+}
+
 TexturedQuad::~TexturedQuad() {
     glDeleteTextures(1, &m_texture);
 }
 
+int TexturedQuad::max_untiled_size() {
+    static GLint max_size = 0;
+    if (max_size == 0)
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    return std::min(4096, (int)max_size);
+}
+
+unsigned long TexturedQuad::contentRevision() const {
+    // both only grow
+    return m_revision + (m_tiles ? m_tiles->revision() : 0);
+}
+
+const std::vector<TilePyramid::Tile>& TexturedQuad::parts(const glm::mat4& mvp, const Viewport& v) const {
+    static const std::vector<TilePyramid::Tile> whole = {{ glm::vec4(0, 0, 1, 1), glm::vec4(0, 0, 1, 1) }};
+    return m_tiles ? m_tiles->select(mvp, v, m_ratio) : whole;
+}
+
+int TexturedQuad::progressive() const {
+    return m_accumulator ? m_accumulator->samples() : 0;
+}
+
+void TexturedQuad::set_progressive(int samples) {
+    if (samples <= 0)
+        m_accumulator.reset();
+    else if (m_accumulator)
+        m_accumulator->set_samples(samples);
+    else
+        m_accumulator.reset(new Accumulator(samples));
+}
+
 namespace { namespace DrawShader {
     GLuint program = 0;
 
+    // draws the part rect of the quad, from the part atlas of the texture. both are the whole of it unless tiled
     const char* vert = R"VERT(#version 300 es
-precision mediump float;
+precision highp float;
 layout (location = 0) in vec3 Position;
 uniform float ratio;
 uniform mat4 mvp;
+uniform vec4 rect;
+uniform vec4 atlas;
 out vec2 uv;
 void main()
 {
-    uv = 0.5 * (Position.xy + vec2(1,1));
-    gl_Position = mvp * vec4(ratio * Position.x, Position.y, Position.z, 1);
+    vec2 corner = 0.5 * (Position.xy + vec2(1,1));
+    uv = atlas.xy + corner * atlas.zw;
+    vec2 pos = 2.0 * (rect.xy + corner * rect.zw) - vec2(1,1);
+    gl_Position = mvp * vec4(ratio * pos.x, pos.y, Position.z, 1);
 })VERT";
 
     const char* frag = R"FRAG(#version 300 es
 precision mediump float;
 layout (location = 0) out vec4 Out_Color;
-in vec2 uv;
+in highp vec2 uv;
 uniform sampler2D sampler;
+uniform int channels;
 void main()
 {
-    Out_Color = texture(sampler, uv);
+    vec4 s = texture(sampler, uv);
+    // greyscale textures only have red, and alpha in green
+    Out_Color = channels == 1 ? vec4(s.rrr, 1) : channels == 2 ? vec4(s.rrr, s.g) : s;
 })FRAG";
 
     GLuint MvpID;
     GLuint SamplerID;
+    GLuint ChannelsID;
     GLuint RatioID;
+    GLuint RectID;
+    GLuint AtlasID;
 
     void init() {
         if (program == 0) {
@@ -111,17 +170,32 @@ void main()
             }
             MvpID = glGetUniformLocation(program, "mvp");
             SamplerID = glGetUniformLocation(program, "sampler");
+            ChannelsID = glGetUniformLocation(program, "channels");
             RatioID = glGetUniformLocation(program, "ratio");
+            RectID = glGetUniformLocation(program, "rect");
+            AtlasID = glGetUniformLocation(program, "atlas");
         }
     }
 }}
 
 void TexturedQuad::render(const Camera& cam, const glm::mat4* model) const
+{
+    if (!m_accumulator) {
+        draw(model ? cam.projection_view() * *model : cam.projection_view(), cam.viewport());
+        return;
+    }
+    m_accumulator->render(cam, contentRevision(), [&](const Accumulator::Sample& s) {
+        draw(model ? s.projection_view * *model : s.projection_view, s.viewport);
+    });
+}
+
+void TexturedQuad::draw(const glm::mat4& mvp, const Viewport& v) const
 {
     using namespace DrawShader;
     DrawShader::init();
-
-    auto mvp = model ? cam.projection_view() * *model : cam.projection_view();
+    // before binding anything, the tiles may be uploaded and the strokes drawn
+    const auto& drawn = parts(mvp, v);
+    flushStrokes();
 
     glUseProgram(program);
 
@@ -129,38 +203,59 @@ void TexturedQuad::render(const Camera& cam, const glm::mat4* model) const
     glUniform1fv(RatioID, 1, &m_ratio);
 
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glBindTexture(GL_TEXTURE_2D, m_tiles ? m_tiles->atlas() : m_texture);
     glUniform1i(SamplerID, 0);
+    glUniform1i(ChannelsID, m_channels);
 
     glEnableVertexAttribArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, Buffers::verticesBuffer);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    for (const auto& part : drawn) {
+        glUniform4fv(RectID, 1, &part.rect[0]);
+        glUniform4fv(AtlasID, 1, &part.atlas[0]);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+    }
 }
 
 namespace { namespace PaintShader {
     bool ok = false;
 
     GLuint program;
+    // one instance per stroke, covering the bounds of its capsule
     const char* vert = R"VERT(#version 300 es
-precision mediump float;
+precision highp float;
 layout (location = 0) in vec3 Position;
+layout (location = 1) in vec4 segment; // its ends, in texels with x scaled by blob_ratio
+layout (location = 2) in vec4 stroke;  // radius, blob_ratio, label
+uniform vec2 size;
+flat out vec4 segment_ends;
+flat out vec4 stroke_params;
 void main()
 {
-    gl_Position = vec4(Position, 1);
+    // a texel larger, for the texels whose centre is on the edge of the capsule
+    vec2 scale = vec2(stroke.y, 1);
+    vec2 lo = (min(segment.xy, segment.zw) - stroke.x) / scale - 1.0;
+    vec2 hi = (max(segment.xy, segment.zw) + stroke.x) / scale + 1.0;
+    vec2 texel = mix(lo, hi, Position.xy * 0.5 + 0.5);
+    gl_Position = vec4(texel / size * 2.0 - 1.0, 0, 1);
+    segment_ends = segment;
+    stroke_params = stroke;
 })VERT";
 
+    // highp for the capsule to cover the same texels as LabelMap's
     const char* frag = R"FRAG(#version 300 es
-precision mediump float;
+precision highp float;
 layout (location = 0) out vec4 Out_Color;
-uniform vec2 segmentA;
-uniform vec2 segmentB;
-uniform float radius;
-uniform float blob_ratio;
-uniform float label_color;
+flat in vec4 segment_ends;
+flat in vec4 stroke_params;
 void main()
 {
+    vec2 segmentA = segment_ends.xy;
+    vec2 segmentB = segment_ends.zw;
+    float radius = stroke_params.x;
+    float blob_ratio = stroke_params.y;
+    float label_color = stroke_params.z;
     vec2 pos = vec2(gl_FragCoord.x * blob_ratio, gl_FragCoord.y); // put pos in original image coordinates
     float segmentLength = dot(segmentB -segmentA, segmentB - segmentA);
     if (segmentLength == 0.0) {
@@ -176,13 +271,10 @@ void main()
     Out_Color = vec4(label_color, 0, 0, 1);
 })FRAG";
 
-    GLuint SegmentAID;
-    GLuint SegmentBID;
-    GLuint RadiusID;
-    GLuint BlobRatioID;
-    GLuint LabelColorID;
+    GLuint SizeID;
 
     GLuint frameBuffer;
+    GLuint strokesBuffer;
 
     void init() {
         if (ok)
@@ -191,13 +283,10 @@ void main()
             Log::Error("Error creating program");
             return;
         }
-        SegmentAID = glGetUniformLocation(program, "segmentA");
-        SegmentBID = glGetUniformLocation(program, "segmentB");
-        RadiusID = glGetUniformLocation(program, "radius");
-        BlobRatioID = glGetUniformLocation(program, "blob_ratio");
-        LabelColorID = glGetUniformLocation(program, "label_color");
+        SizeID = glGetUniformLocation(program, "size");
 
         glGenFramebuffers(1, &frameBuffer);
+        glGenBuffers(1, &strokesBuffer);
         ok = true;
     }
 }}
@@ -230,6 +319,10 @@ void TexturedQuad::paint(glm::vec2 from,
                          float radius,
                          float blob_ratio)
 {
+    if (m_tiles) {
+        Log::Error("Can't paint a tiled image");
+        return;
+    }
     blob_ratio /= m_ratio;
     from *= glm::vec2{ blob_ratio * m_width, m_height };
     to *= glm::vec2{ blob_ratio * m_width, m_height };
@@ -242,60 +335,117 @@ void TexturedQuad::paint(glm::vec2 from,
         return;
     }
 
+    // drawn with the next ones before the texture is used, in one pass
+    m_strokes.push_back({ { to, from }, { radius, blob_ratio, (float)color / 255.0f, 0.f } });
+    ++m_revision;
+    Engine::request_frames();
+}
+
+void TexturedQuad::update(int x, int y, int w, int h, const void* data, int row_length)
+{
+    if (m_tiles) {
+        Log::Error("Can't update a tiled image");
+        return;
+    }
+    // the strokes painted before are under the update
+    flushStrokes();
+    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GlUtils::format(m_channels), m_type, data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    ++m_revision;
+    Engine::request_frames();
+}
+
+void TexturedQuad::flushStrokes() const
+{
+    if (m_strokes.empty())
+        return;
+    PROFILE_SCOPE("paint");
     using namespace PaintShader;
     init();
 
+    // may be called while rendering to another target, see Accumulator
+    GLint previous_frame_buffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous_frame_buffer);
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLboolean blend = glIsEnabled(GL_BLEND);
+
     glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texture, 0);
+    glDisable(GL_BLEND);
 
     glViewport(0, 0, m_width, m_height);
     glUseProgram(program);
-
-    glUniform2fv(SegmentAID, 1, &to[0]);
-    glUniform2fv(SegmentBID, 1, &from[0]);
-    glUniform1fv(RadiusID, 1, &radius);
-    glUniform1fv(BlobRatioID, 1, &blob_ratio);
-    float color_floated = (float)color / 255.0f;
-    glUniform1fv(LabelColorID, 1, &color_floated);
+    const glm::vec2 size{ m_width, m_height };
+    glUniform2fv(SizeID, 1, &size[0]);
 
     glEnableVertexAttribArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, Buffers::verticesBuffer);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
-    glDrawArrays(GL_TRIANGLES, 0, 6);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    // TODO restore
-    glViewport(0, 0, Engine::input().width, Engine::input().height);
+    // drawn in order, the last stroke over a texel wins
+    glBindBuffer(GL_ARRAY_BUFFER, strokesBuffer);
+    glBufferData(GL_ARRAY_BUFFER, m_strokes.size() * sizeof(Stroke), m_strokes.data(), GL_STREAM_DRAW);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Stroke), (void*)offsetof(Stroke, segment));
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Stroke), (void*)offsetof(Stroke, params));
+    glVertexAttribDivisor(2, 1);
+
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, m_strokes.size());
+    m_strokes.clear();
+
+    glVertexAttribDivisor(1, 0);
+    glDisableVertexAttribArray(1);
+    glVertexAttribDivisor(2, 0);
+    glDisableVertexAttribArray(2);
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_frame_buffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (blend)
+        glEnable(GL_BLEND);
 }
 
 namespace { namespace TextureWithLabelsShader {
     bool okay = false;
     GLuint program;
 
+    // same parts as DrawShader, the labels cover the whole quad
     const char* vert = R"VERT(#version 300 es
-precision mediump float;
+precision highp float;
 layout (location = 0) in vec3 Position;
 uniform float ratio;
 uniform mat4 mvp;
+uniform vec4 rect;
+uniform vec4 atlas;
 out vec2 uv;
+out vec2 label_uv;
 void main()
 {
-    uv = 0.5 * (Position.xy + vec2(1,1));
-    gl_Position = mvp * vec4(ratio * Position.x, Position.y, Position.z, 1);
+    vec2 corner = 0.5 * (Position.xy + vec2(1,1));
+    uv = atlas.xy + corner * atlas.zw;
+    label_uv = rect.xy + corner * rect.zw;
+    vec2 pos = 2.0 * label_uv - vec2(1,1);
+    gl_Position = mvp * vec4(ratio * pos.x, pos.y, Position.z, 1);
 })VERT";
 
     const char* frag = R"FRAG(#version 300 es
 precision mediump float;
 layout (location = 0) out vec4 Out_Color;
-in vec2 uv;
+in highp vec2 uv;
+in highp vec2 label_uv;
 uniform float factor;
 uniform sampler2D tex1Sampler;
 uniform sampler2D tex2Sampler;
+uniform int channels;
 void main()
 {
     vec4 sample1 = texture(tex1Sampler, uv);
-    vec4 sample2 = texture(tex2Sampler, uv);
+    sample1 = channels == 1 ? vec4(sample1.rrr, 1) : channels == 2 ? vec4(sample1.rrr, sample1.g) : sample1;
+    vec4 sample2 = texture(tex2Sampler, label_uv);
     int index = int(round(clamp(255.0f * sample2.r, 0.0f, 254.0f)));
     if (index == 1)
         Out_Color = mix(sample1, vec4(0,1,0,1), factor);
@@ -310,6 +460,9 @@ void main()
     GLuint FactorID;
     GLuint Tex1SamplerID;
     GLuint Tex2SamplerID;
+    GLuint RectID;
+    GLuint AtlasID;
+    GLuint ChannelsID;
 
     void init() {
         if (okay)
@@ -323,6 +476,9 @@ void main()
         FactorID = glGetUniformLocation(program, "factor");
         Tex1SamplerID = glGetUniformLocation(program, "tex1Sampler");
         Tex2SamplerID = glGetUniformLocation(program, "tex2Sampler");
+        RectID = glGetUniformLocation(program, "rect");
+        AtlasID = glGetUniformLocation(program, "atlas");
+        ChannelsID = glGetUniformLocation(program, "channels");
         okay = true;
     }
 }}
@@ -331,11 +487,23 @@ void TexturedQuad::renderWithLabels(const Camera& cam,
                                    const TexturedQuad& labels,
                                    float label_opacity,
                                    const glm::mat4* model) const
+{
+    if (!m_accumulator) {
+        drawWithLabels(model ? cam.projection_view() * *model : cam.projection_view(), cam.viewport(), labels, label_opacity);
+        return;
+    }
+    size_t content = contentRevision() ^ (labels.m_revision << 1) ^ (std::hash<float>()(label_opacity) << 2);
+    m_accumulator->render(cam, content, [&](const Accumulator::Sample& s) {
+        drawWithLabels(model ? s.projection_view * *model : s.projection_view, s.viewport, labels, label_opacity);
+    });
+}
+
+void TexturedQuad::drawWithLabels(const glm::mat4& mvp, const Viewport& v, const TexturedQuad& labels, float label_opacity) const
 {
     using namespace TextureWithLabelsShader;
     init();
-
-    auto mvp = model ? cam.projection_view() * *model : cam.projection_view();
+    const auto& drawn = parts(mvp, v);
+    labels.flushStrokes();
 
     glUseProgram(program);
 
@@ -344,8 +512,9 @@ void TexturedQuad::renderWithLabels(const Camera& cam,
     glUniform1fv(FactorID, 1, &label_opacity);
 
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, m_texture);
+    glBindTexture(GL_TEXTURE_2D, m_tiles ? m_tiles->atlas() : m_texture);
     glUniform1i(Tex1SamplerID, 0);
+    glUniform1i(ChannelsID, m_channels);
 
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_2D, labels.m_texture);
@@ -355,34 +524,36 @@ void TexturedQuad::renderWithLabels(const Camera& cam,
     glBindBuffer(GL_ARRAY_BUFFER, Buffers::verticesBuffer);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    for (const auto& part : drawn) {
+        glUniform4fv(RectID, 1, &part.rect[0]);
+        glUniform4fv(AtlasID, 1, &part.atlas[0]);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+    }
 }
 
 bool TexturedQuad::exportPixels(std::vector<unsigned char>& pixels) const
 {
-    GLuint fb;
-    glGenFramebuffers(1, &fb);
-    glBindFramebuffer(GL_FRAMEBUFFER, fb);
-
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texture, 0);
-
-    glViewport(0, 0, m_width, m_height);
+    bool ok = false;
+    exportPixelsAsync([&](std::vector<unsigned char>&& exported) {
+        pixels = std::move(exported);
+        ok = true;
+    });
+    Readback::finish();
+    return ok;
+}
 
-    GLenum format = 0;
-    switch (m_channels) {
-        case 1: format = GL_RED; break;
-        case 2: format = GL_RG; break;
-        case 3: format = GL_RGB; break;
-        case 4: format = GL_RGBA; break;
-        default: Log::Error("Invalid channels number"); break;
+void TexturedQuad::exportPixelsAsync(Readback::Done done) const
+{
+    // 16 bits textures can't be read back in webgl2, and tiled images have none to read
+    if (m_type != GL_UNSIGNED_BYTE) {
+        Log::Error("Can't export a 16 bits image");
+        return;
+    }
+    if (m_tiles) {
+        const auto data = m_tiles->pixels(0);
+        done(std::vector<unsigned char>(data, data + (size_t)m_width * m_height * m_channels));
+        return;
     }
-    pixels.resize(m_width * m_height * m_channels);
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glReadPixels(0, 0, m_width, m_height, format, GL_UNSIGNED_BYTE, pixels.data());
-
-    glDeleteFramebuffers(1, &fb);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    // TODO restore
-    glViewport(0, 0, Engine::input().width, Engine::input().height);
-    return true;
+    flushStrokes();
+    Readback::read(m_texture, m_width, m_height, m_channels, std::move(done));
 }
@@ -1,18 +1,32 @@
 #pragma once
 
 #include <glm/mat4x4.hpp>
+#include <memory>
 #include <optional>
 #include <vector>
 
 #include <GLES3/gl3.h>
 #include "camera.hpp"
+#include "readback.hpp"
+#include "tile_pyramid.hpp"
+
+class Accumulator;
 
 class TexturedQuad {
 public:
-    TexturedQuad(const unsigned char* data, int w, int h, int c, bool nearest = false);
+    // type is GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT if GlUtils::norm16(), or GL_HALF_FLOAT. greyscale images are
+    // 1 channel, with alpha 2
+    TexturedQuad(const void* data, int w, int h, int c, bool nearest = false, GLenum type = GL_UNSIGNED_BYTE);
     TexturedQuad(int w, int h, int c, bool nearest = false);
+    // tiled, for images too large to be a single texture: pixels are kept as the finest level of a TilePyramid
+    // and only the tiles in view are uploaded. it can't be painted or updated, nor be the labels of another quad
+    TexturedQuad(std::shared_ptr<const unsigned char> pixels, int w, int h, int c, GLenum type = GL_UNSIGNED_BYTE);
+    explicit TexturedQuad(std::unique_ptr<TilePyramid> tiles);
     ~TexturedQuad();
 
+    // larger images have to be tiled, or would take too much video memory otherwise. main thread only
+    static int max_untiled_size();
+
     void render(const Camera& cam,
                 const glm::mat4* model = nullptr) const;
 
@@ -26,26 +40,58 @@ public:
                    const glm::vec2& cursor,     // in [-1, 1] screen-coordinates (-1,-1 is bottom-left)
                    glm::vec2& outPicked) const; // in quad-local-coordinates ([-ratio, ratio] in width, [-1, 1] in height)
 
+    // queued, the strokes of a frame are drawn together before the texture is next used
     void paint(glm::vec2 from, // in [0, 1] texture coordinates
                glm::vec2 to,   // same
                int color,
                float radius,
                float blob_ratio);
 
+    // replaces a rectangle of the texture from rows of row_length texels, in the quad's channels and type
+    void update(int x, int y, int w, int h, const void* data, int row_length);
+
+    // in the quad's channels, 8 bits only. waits for the gpu, see exportPixelsAsync
     bool exportPixels(std::vector<unsigned char>& pixels) const;
+    // done is called frames later, once the pixels have arrived, or never on errors. see Readback
+    void exportPixelsAsync(Readback::Done done) const;
 
     int width() const { return m_width; }
     int height() const { return m_height; }
     int channels() const { return m_channels; }
+    GLenum type() const { return m_type; }
     float ratio() const { return m_ratio; }
-    GLuint texture() const { return m_texture; }
+    GLuint texture() const { return m_texture; } // 0 if tiled
+    bool tiled() const { return m_tiles != nullptr; }
+    unsigned long revision() const { return m_revision; } // changes when painted or updated
+
+    // number of jittered frames averaged while the view doesn't change, 0 to render every frame from scratch
+    // the subpixel jitter antialiases the image when it is minified
+    int progressive() const;
+    void set_progressive(int samples);
 
     static GLuint verticesBuffer();
 
 private:
+    void draw(const glm::mat4& mvp, const Viewport& v) const;
+    void drawWithLabels(const glm::mat4& mvp, const Viewport& v, const TexturedQuad& labels, float label_opacity) const;
+    // the parts of the quad to draw, all of it in one piece unless tiled
+    const std::vector<TilePyramid::Tile>& parts(const glm::mat4& mvp, const Viewport& v) const;
+    unsigned long contentRevision() const;
+    void flushStrokes() const;
+
     int m_width;
     int m_height;
     int m_channels;
+    GLenum m_type = GL_UNSIGNED_BYTE;
     float m_ratio;
-    GLuint m_texture;
+    GLuint m_texture = 0;
+    unsigned long m_revision = 0;
+    std::unique_ptr<Accumulator> m_accumulator;
+    std::unique_ptr<TilePyramid> m_tiles;
+
+    struct Stroke {
+        glm::vec4 segment; // its ends, in texels with x scaled by blob_ratio
+        glm::vec4 params;  // radius, blob_ratio, label / 255
+    };
+    mutable std::vector<Stroke> m_strokes; // painted but not drawn yet
 };
@@ -0,0 +1,94 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(int threads)
+{
+#if defined(__EMSCRIPTEN__) and not defined(__EMSCRIPTEN_PTHREADS__)
+    // no threads without pthreads support, everything runs on the calling thread
+    threads = 0;
+#else
+    // at least one, for background work to leave the calling thread even on a single core
+    if (threads <= 0)
+        threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+#endif
+    for (int i = 0; i < threads; ++i)
+        m_workers.emplace_back([this] { work(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    for (auto& worker : m_workers)
+        worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    if (m_workers.empty()) {
+        task();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_cond.notify_one();
+}
+
+void ThreadPool::parallel_for(int count, const std::function<void(int)>& func)
+{
+    struct State {
+        std::atomic<int> next{0};
+        int done = 0;
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+    auto state = std::make_shared<State>();
+    // helpers that start after everything has been claimed return without touching func
+    auto run = [state, count, &func] {
+        int n = 0;
+        for (int i = state->next++; i < count; i = state->next++) {
+            func(i);
+            ++n;
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done += n;
+        state->cond.notify_all();
+    };
+    int helpers = std::min(count - 1, size());
+    for (int i = 0; i < helpers; ++i)
+        submit(run);
+    run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cond.wait(lock, [&] { return state->done == count; });
+}
+
+ThreadPool& ThreadPool::global()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::work()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_stop or !m_tasks.empty(); });
+            if (m_stop and m_tasks.empty())
+                return;
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    // 0 uses one thread per core minus the calling one, at least one
+    explicit ThreadPool(int threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> task);
+
+    // runs func(i) for each i in [0, count) on the workers and the calling thread, and waits for all of them
+    void parallel_for(int count, const std::function<void(int)>& func);
+
+    int size() const { return m_workers.size(); }
+
+    // shared by everything that doesn't need its own workers
+    static ThreadPool& global();
+
+private:
+    void work();
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_stop = false;
+};
@@ -0,0 +1,279 @@
+#include "tile_pyramid.hpp"
+#include "engine.hpp"
+#include "glUtils.hpp"
+#include "log.hpp"
+#include "profiler.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace {
+    const int slot_size = TilePyramid::tile_size + 2; // with one texel of apron on each side, for filtering
+    const int max_atlas_slots = 16;     // per side, 4128x4128 texels
+    const int uploads_per_frame = 16;
+    const size_t max_selected = 1024;   // in case of a degenerate view
+
+    // box filters a level into the next, the last row and column are repeated for odd sizes
+    template<typename T, typename Average>
+    void halve(const unsigned char* src, int width, int height, int c, unsigned char* dst, const Average& average) {
+        const int next_width = (width + 1) / 2;
+        ThreadPool::global().parallel_for((height + 1) / 2, [&](int y) {
+            auto row0 = reinterpret_cast<const T*>(src) + (size_t)(2 * y) * width * c;
+            auto row1 = reinterpret_cast<const T*>(src) + (size_t)std::min(2 * y + 1, height - 1) * width * c;
+            auto out = reinterpret_cast<T*>(dst) + (size_t)y * next_width * c;
+            for (int x = 0; x < next_width; ++x) {
+                const int x0 = 2 * x * c;
+                const int x1 = std::min(2 * x + 1, width - 1) * c;
+                for (int i = 0; i < c; ++i)
+                    out[x * c + i] = average(row0[x0 + i], row0[x1 + i], row1[x0 + i], row1[x1 + i]);
+            }
+        });
+    }
+}
+
+TilePyramid::TilePyramid(std::shared_ptr<const unsigned char> pixels, int w, int h, int c, GLenum type)
+    : m_channels(c)
+    , m_type(type)
+    , m_texel_size(c * GlUtils::typeSize(type))
+    , m_pixels(std::move(pixels))
+{
+    auto tiles = [](int size) { return (size + tile_size - 1) / tile_size; };
+    m_levels.push_back({ w, h, tiles(w), tiles(h), m_pixels.get(), {}, {} });
+    while (m_levels.back().width > tile_size or m_levels.back().height > tile_size) {
+        const Level& prev = m_levels.back();
+        Level next;
+        next.width = (prev.width + 1) / 2;
+        next.height = (prev.height + 1) / 2;
+        next.tiles_x = tiles(next.width);
+        next.tiles_y = tiles(next.height);
+        next.pixels.resize((size_t)next.width * next.height * m_texel_size);
+        if (type == GL_HALF_FLOAT) {
+            halve<uint16_t>(prev.data, prev.width, prev.height, c, next.pixels.data(), [](uint16_t a, uint16_t b, uint16_t d, uint16_t e) {
+                using namespace GlUtils;
+                return toHalf(0.25f * (fromHalf(a) + fromHalf(b) + fromHalf(d) + fromHalf(e)));
+            });
+        } else if (type == GL_UNSIGNED_SHORT) {
+            halve<uint16_t>(prev.data, prev.width, prev.height, c, next.pixels.data(), [](int a, int b, int d, int e) {
+                return (uint16_t)((a + b + d + e + 2) / 4);
+            });
+        } else {
+            halve<unsigned char>(prev.data, prev.width, prev.height, c, next.pixels.data(), [](int a, int b, int d, int e) {
+                return (unsigned char)((a + b + d + e + 2) / 4);
+            });
+        }
+        next.data = next.pixels.data();
+        m_levels.push_back(std::move(next));
+    }
+    for (auto& l : m_levels)
+        l.slots.assign(l.tiles_x * l.tiles_y, -1);
+
+    Log::Info(FMT("tiled image: {} levels"), m_levels.size());
+}
+
+TilePyramid::~TilePyramid() {
+    if (m_atlas)
+        glDeleteTextures(1, &m_atlas);
+}
+
+void TilePyramid::init()
+{
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    m_slots_x = m_slots_y = std::max(1, std::min(max_atlas_slots, max_size / slot_size));
+    m_slots.resize(m_slots_x * m_slots_y);
+
+    glGenTextures(1, &m_atlas);
+    glBindTexture(GL_TEXTURE_2D, m_atlas);
+    glTexImage2D(GL_TEXTURE_2D, 0, GlUtils::internalFormat(m_channels, m_type), m_slots_x * slot_size, m_slots_y * slot_size, 0,
+                 GlUtils::format(m_channels), m_type, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // the coarsest tile is never evicted, so that there is always something to draw
+    upload(m_levels.size() - 1, 0, 0);
+    m_slots[m_levels.back().slots[0]].used = std::numeric_limits<unsigned long>::max();
+}
+
+glm::vec4 TilePyramid::rect(int level, int x, int y) const
+{
+    const auto& l = m_levels[level];
+    const int x0 = x * tile_size;
+    const int y0 = y * tile_size;
+    return { (float)x0 / l.width, (float)y0 / l.height,
+             (float)std::min(tile_size, l.width - x0) / l.width, (float)std::min(tile_size, l.height - y0) / l.height };
+}
+
+glm::vec4 TilePyramid::atlasRect(int level, int x, int y) const
+{
+    const auto& l = m_levels[level];
+    const int slot = l.slots[y * l.tiles_x + x];
+    const float width = m_slots_x * slot_size;
+    const float height = m_slots_y * slot_size;
+    return { ((slot % m_slots_x) * slot_size + 1) / width, ((slot / m_slots_x) * slot_size + 1) / height,
+             std::min(tile_size, l.width - x * tile_size) / width, std::min(tile_size, l.height - y * tile_size) / height };
+}
+
+bool TilePyramid::upload(int level, int x, int y)
+{
+    // the least recently used slot, except those of the current frame
+    int best = -1;
+    for (size_t i = 0; i < m_slots.size(); ++i)
+        if (m_slots[i].used < m_frame and (best < 0 or m_slots[i].used < m_slots[best].used))
+            best = i;
+    if (best < 0)
+        return false;
+
+    auto& slot = m_slots[best];
+    if (slot.level >= 0)
+        m_levels[slot.level].slots[slot.tile] = -1;
+
+    auto& l = m_levels[level];
+    const int texel = m_texel_size;
+    m_staging.resize(slot_size * slot_size * texel);
+    for (int ly = 0; ly < slot_size; ++ly) {
+        const int sy = std::clamp(y * tile_size - 1 + ly, 0, l.height - 1);
+        const unsigned char* row = l.data + (size_t)sy * l.width * texel;
+        unsigned char* out = m_staging.data() + ly * slot_size * texel;
+        // the inside of the row in one go, then the apron and the clamped texels past the edge of the image
+        const int x0 = x * tile_size;
+        const int inside = std::min(tile_size, l.width - x0);
+        std::memcpy(out + texel, row + (size_t)x0 * texel, inside * texel);
+        for (int lx = 0; lx < slot_size; ++lx) {
+            if (lx >= 1 and lx <= inside)
+                continue;
+            const int sx = std::clamp(x0 - 1 + lx, 0, l.width - 1);
+            std::memcpy(out + lx * texel, row + (size_t)sx * texel, texel);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, m_atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, (best % m_slots_x) * slot_size, (best / m_slots_x) * slot_size,
+                    slot_size, slot_size, GlUtils::format(m_channels), m_type, m_staging.data());
+
+    const int tile = y * l.tiles_x + x;
+    slot = { level, tile, m_frame };
+    l.slots[tile] = best;
+    return true;
+}
+
+void TilePyramid::visit(int level, int x, int y, const glm::mat4& mvp, const Viewport& v, float ratio)
+{
+    if (m_wanted.size() >= max_selected)
+        return;
+    const auto r = rect(level, x, y);
+    glm::vec4 corners[4];
+    for (int i = 0; i < 4; ++i) {
+        const float u = r.x + (i & 1) * r.z;
+        const float t = r.y + (i >> 1) * r.w;
+        corners[i] = mvp * glm::vec4(ratio * (2.f * u - 1.f), 2.f * t - 1.f, 0.f, 1.f);
+    }
+    // out of view if all the corners are outside of the same frustum plane
+    for (int axis = 0; axis < 3; ++axis) {
+        bool below = true;
+        bool above = true;
+        for (const auto& c : corners) {
+            below = below and c[axis] < -c.w;
+            above = above and c[axis] > c.w;
+        }
+        if (below or above)
+            return;
+    }
+
+    // finer when a texel would cover more than a pixel, or when the tile crosses the camera plane and its size is unknown
+    bool refine = false;
+    if (level > 0) {
+        glm::vec2 screen[4];
+        for (int i = 0; i < 4 and !refine; ++i) {
+            refine = corners[i].w <= 1e-6f;
+            screen[i] = glm::vec2(corners[i].x, corners[i].y) / corners[i].w * 0.5f * glm::vec2(v.width, v.height);
+        }
+        const auto& l = m_levels[level];
+        const float texels_x = r.z * l.width;
+        const float texels_y = r.w * l.height;
+        refine = refine
+            or glm::length(screen[1] - screen[0]) > texels_x or glm::length(screen[3] - screen[2]) > texels_x
+            or glm::length(screen[2] - screen[0]) > texels_y or glm::length(screen[3] - screen[1]) > texels_y;
+    }
+    if (!refine) {
+        m_wanted.push_back({ level, x, y });
+        return;
+    }
+    const auto& finer = m_levels[level - 1];
+    for (int fy = 2 * y; fy < std::min(2 * y + 2, finer.tiles_y); ++fy)
+        for (int fx = 2 * x; fx < std::min(2 * x + 2, finer.tiles_x); ++fx)
+            visit(level - 1, fx, fy, mvp, v, ratio);
+}
+
+const std::vector<TilePyramid::Tile>& TilePyramid::select(const glm::mat4& mvp, const Viewport& v, float ratio)
+{
+    // the views drawn in a frame keep each other's tiles, and share its uploads
+    if (Engine::frame() + 1 != m_frame) {
+        m_frame = Engine::frame() + 1;
+        m_uploads = 0;
+    }
+    if (m_atlas == 0)
+        init();
+    m_wanted.clear();
+    m_selected.clear();
+    visit(m_levels.size() - 1, 0, 0, mvp, v, ratio);
+
+    auto slotOf = [&](int level, int x, int y) -> int& { return m_levels[level].slots[y * m_levels[level].tiles_x + x]; };
+
+    // the tiles already there are marked first so that the uploads don't evict them, and the coarse ones go first
+    for (const auto& w : m_wanted) {
+        const int slot = slotOf(w.level, w.x, w.y);
+        if (slot >= 0)
+            m_slots[slot].used = std::max(m_slots[slot].used, m_frame);
+    }
+    std::stable_sort(m_wanted.begin(), m_wanted.end(), [](const Wanted& a, const Wanted& b) { return a.level > b.level; });
+    int uploads = 0;
+    bool missing = false;
+    bool full = false; // of tiles used in this frame, the next frames won't upload more of this view either
+    {
+        PROFILE_SCOPE("tiles");
+        for (const auto& w : m_wanted) {
+            if (slotOf(w.level, w.x, w.y) >= 0)
+                continue;
+            missing = true;
+            if (full or m_uploads >= uploads_per_frame)
+                continue;
+            if (upload(w.level, w.x, w.y)) {
+                ++uploads;
+                ++m_uploads;
+            } else {
+                full = true;
+            }
+        }
+    }
+    if (uploads)
+        ++m_revision;
+
+    for (const auto& w : m_wanted) {
+        const auto r = rect(w.level, w.x, w.y);
+        int level = w.level;
+        int x = w.x;
+        int y = w.y;
+        while (slotOf(level, x, y) < 0) {
+            ++level;
+            x /= 2;
+            y /= 2;
+        }
+        auto a = atlasRect(level, x, y);
+        if (level != w.level) {
+            // the part of the coarser tile covering this one
+            const auto cr = rect(level, x, y);
+            const glm::vec2 scale = { a.z / cr.z, a.w / cr.w };
+            a = { a.x + (r.x - cr.x) * scale.x, a.y + (r.y - cr.y) * scale.y, r.z * scale.x, r.w * scale.y };
+            auto& slot = m_slots[slotOf(level, x, y)];
+            slot.used = std::max(slot.used, m_frame);
+        }
+        m_selected.push_back({ r, a });
+    }
+    if (missing and !full)
+        Engine::request_frames();
+    return m_selected;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+#include <memory>
+#include <vector>
+
+#include <GLES3/gl3.h>
+#include "camera.hpp"
+
+// an image too large for a single texture, kept in memory as a pyramid of halved levels cut in tiles.
+// only the tiles seen at a resolution close to the screen's are uploaded, to an atlas of fixed size from
+// which the tiles least recently used in a frame are evicted. several views of it share the atlas
+class TilePyramid {
+public:
+    static constexpr int tile_size = 256;
+
+    // pixels are kept as the finest level, rows from the bottom like the textures. type is GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT or GL_HALF_FLOAT
+    // doesn't touch gl until select(), so that it can be built on another thread
+    TilePyramid(std::shared_ptr<const unsigned char> pixels, int w, int h, int c, GLenum type = GL_UNSIGNED_BYTE);
+    ~TilePyramid();
+
+    TilePyramid(const TilePyramid&) = delete;
+    TilePyramid& operator=(const TilePyramid&) = delete;
+
+    struct Tile {
+        glm::vec4 rect;  // part of the image, in [0, 1] texture coordinates: offset then size
+        glm::vec4 atlas; // where it is in the atlas, same
+    };
+    // the tiles covering what mvp sees of the quad (see TexturedQuad) in the viewport, coarser tiles standing in
+    // for the ones not uploaded yet. uploads a few of those per frame, whatever the number of calls, and requests
+    // frames until all are there or the atlas is full of the frame's tiles
+    const std::vector<Tile>& select(const glm::mat4& mvp, const Viewport& v, float ratio);
+
+    GLuint atlas() const { return m_atlas; }
+    unsigned long revision() const { return m_revision; } // changes when tiles are uploaded
+
+    int width() const { return m_levels[0].width; }
+    int height() const { return m_levels[0].height; }
+    int channels() const { return m_channels; }
+    GLenum type() const { return m_type; }
+    int levels() const { return m_levels.size(); }
+    const unsigned char* pixels(int level) const { return m_levels[level].data; }
+
+private:
+    struct Level {
+        int width;
+        int height;
+        int tiles_x;
+        int tiles_y;
+        const unsigned char* data;
+        std::vector<unsigned char> pixels; // empty for the finest level, which is m_pixels
+        std::vector<int> slots;            // atlas slot of each tile, -1 if not uploaded
+    };
+    struct Slot {
+        int level = -1;
+        int tile = -1;
+        unsigned long used = 0; // frame that last used it, see m_frame. 0 if free
+    };
+    struct Wanted {
+        int level;
+        int x;
+        int y;
+    };
+
+    void init();
+    void visit(int level, int x, int y, const glm::mat4& mvp, const Viewport& v, float ratio);
+    bool upload(int level, int x, int y);
+    glm::vec4 rect(int level, int x, int y) const;
+    glm::vec4 atlasRect(int level, int x, int y) const;
+
+    int m_channels;
+    GLenum m_type;
+    int m_texel_size; // in bytes
+    std::shared_ptr<const unsigned char> m_pixels;
+    std::vector<Level> m_levels; // the first is the finest, the last a single tile
+    GLuint m_atlas = 0;
+    int m_slots_x = 0;
+    int m_slots_y = 0;
+    std::vector<Slot> m_slots;
+    unsigned long m_frame = 0;     // Engine::frame() + 1 at the last select, above the free slots'
+    int m_uploads = 0;             // in that frame
+    unsigned long m_revision = 0;
+
+    std::vector<Wanted> m_wanted;
+    std::vector<Tile> m_selected;
+    std::vector<unsigned char> m_staging;
+};
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <utility>
 
 template<typename T>
@@ -54,9 +60,93 @@ namespace detail
     inline const std::string& format_param(const std::string& val) { return val; }
     inline const char* format_param(const char* val) { return val; }
 
-    inline std::string format_impl(StringView fmt, std::initializer_list<StringView> params);
+    std::string format_impl(StringView fmt, std::initializer_list<StringView> params);
+
+    // walks a format string, calling text(begin, end) for the literal parts and param(index) for the placeholders.
+    // "{}" is the next parameter, "{1}" the second one, and a backslash escapes the next char
+    template<typename Text, typename Param>
+    void format_parse(StringView fmt, size_t param_count, Text&& text, Param&& param)
+    {
+        size_t implicitIndex = 0;
+        for (auto it = fmt.begin(), end = fmt.end(); it != end;) {
+            auto current = it;
+            while (true) {
+                if (current == end) {
+                    text(it, current);
+                    break;
+                } else if (*current == '\\') {
+                    text(it, current);
+                    ++current; // points to the escaped char
+                    if (current == end)
+                        break;
+                    text(current, current + 1);
+                    ++current; // points to the rest
+                    break;
+                } else if (*current == '{') {
+                    text(it, current);
+                    auto closing = std::find(current, end, '}');
+                    if (closing == end)
+                        throw std::runtime_error("format string error, unclosed '{'");
+
+                    size_t index;
+                    if (closing == current + 1)
+                        index = implicitIndex++;
+                    else
+                        index = std::stoi(std::string{current + 1, closing});
+
+                    if (index >= param_count)
+                        throw std::runtime_error("format string parameter index too big");
+
+                    param(index);
+                    current = closing + 1; // points to the rest
+                    break;
+                }
+                ++current;
+            }
+            it = current;
+        }
+    }
+
+    // the number of parameters a format string uses, the highest index + 1, or -1 if it is malformed.
+    // same syntax as format_parse, but at compile time
+    constexpr int format_param_count(std::string_view fmt)
+    {
+        int implicitIndex = 0;
+        int count = 0;
+        for (size_t i = 0; i < fmt.size(); ++i) {
+            if (fmt[i] == '\\') {
+                ++i;
+                continue;
+            }
+            if (fmt[i] != '{')
+                continue;
+            auto closing = fmt.find('}', i);
+            if (closing == std::string_view::npos)
+                return -1;
+            int index = 0;
+            if (closing == i + 1)
+                index = implicitIndex++;
+            for (size_t j = i + 1; j < closing; ++j) {
+                if (fmt[j] < '0' or fmt[j] > '9')
+                    return -1;
+                index = index * 10 + (fmt[j] - '0');
+            }
+            count = std::max(count, index + 1);
+            i = closing;
+        }
+        return count;
+    }
+
+    struct FormatStringTag {};
 }
 
+// a format string carried in a type, so that it can be checked against its parameters at compile time.
+// Log::Info(FMT("{} of {}"), a, b) for instance
+#define FMT(s) [] { struct Str : ::detail::FormatStringTag { static constexpr std::string_view value() { return s; } }; return Str{}; }()
+
+template<typename T>
+constexpr bool is_format_string = std::is_base_of_v<detail::FormatStringTag, T>;
+
 template<typename... Types>
 inline std::string format(detail::StringView fmt, Types&&... params)
 {
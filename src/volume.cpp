@@ -1,63 +1,361 @@
 #include "volume.hpp"
+#include "accumulator.hpp"
 #include "log.hpp"
+#include "profiler.hpp"
 #include "cube.hpp"
 #include "shader_functions.hpp"
 #include "engine.hpp"
 #include "textured_quad.hpp"
+#include "glUtils.hpp"
 
-Volume::Volume(const unsigned char* data, glm::ivec3 size, int c)
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+    const int brick_size = 32;
+    const int slot_size = brick_size + 2; // with one voxel of apron on each side, for filtering
+    const unsigned long unused_frames = 60; // before what is kept for a camera is dropped
+}
+
+Volume::Volume(const void* data, glm::ivec3 size, int c, GLenum type, glm::vec3 spacing)
     : m_size(size)
     , m_channels(c)
-    , m_ratio(glm::vec3(size) / glm::vec3(size.z))
+    , m_type(type)
+    , m_ratio(glm::vec3(size) * spacing / glm::vec3(size.z * spacing.z))
 {
-    GLenum format = 0;
-    switch (m_channels) {
-        case 1: format = GL_RED; break;
-        case 2: format = GL_RG; break;
-        case 3: format = GL_RGB; break;
-        case 4: format = GL_RGBA; break;
-        default: Log::Error("Invalid channels number"); break;
-    }
     glGenTextures(1, &m_texture);
 
     glBindTexture(GL_TEXTURE_3D, m_texture);
     assert(m_texture != 0);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_3D, 0, GlUtils::internalFormat(c, type), size.x, size.y, size.z, 0, GlUtils::format(c), type, data);
 
-    unsigned char* other_data = new unsigned char[size.x * size.y * size.z * m_channels];
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+}
+
+Volume::Volume(glm::ivec3 size, int c) : Volume(nullptr, size, c) {
+    auto data = gradient(size, c);
+    upload(data.data(), 0, size.z);
+}
+
+std::vector<unsigned char> Volume::gradient(glm::ivec3 size, int c) {
+    std::vector<unsigned char> data(size.x * size.y * size.z * c);
     int i = 0;
     for (int x = 0; x < size.x; ++x) {
         for (int y = 0; y < size.y; ++y) {
             for (int z = 0; z < size.z; ++z) {
-                other_data[i++] = (float)x / size.x * 255.f;
-                if (m_channels > 1) other_data[i++] = (float)y / size.y * 255.f;
-                if (m_channels > 2) other_data[i++] = (float)z / size.z * 255.f;
-                if (m_channels > 3) other_data[i++] = 30;
+                data[i++] = (float)x / size.x * 255.f;
+                if (c > 1) data[i++] = (float)y / size.y * 255.f;
+                if (c > 2) data[i++] = (float)z / size.z * 255.f;
+                if (c > 3) data[i++] = 30;
+            }
+        }
+    }
+    return data;
+}
+
+Volume::Volume(glm::ivec3 size, int c, GLenum type, glm::vec3 spacing, const RowSource& row, const Progress& progress)
+    : m_size(size)
+    , m_channels(c)
+    , m_type(type)
+    , m_ratio(glm::vec3(size) * spacing / glm::vec3(size.z * spacing.z))
+{
+    const int voxel_bytes = c * (type == GL_HALF_FLOAT ? 2 : 1);
+    // opacity is the intensity for one channel, and the last channel for two or four, rgb is always opaque
+    const int opacity_channel = c == 1 ? 0 : c == 2 ? 1 : c == 4 ? 3 : -1;
+    // half floats are positive here, so their bits compare like the values they represent
+    auto opacity = [&](const void* row, int x) -> uint16_t {
+        if (opacity_channel < 0)
+            return 0xffff;
+        if (type == GL_HALF_FLOAT)
+            return static_cast<const uint16_t*>(row)[x * c + opacity_channel];
+        return static_cast<const unsigned char*>(row)[x * c + opacity_channel];
+    };
+
+    m_brick_grid = (size + brick_size - 1) / brick_size;
+    m_bricks.resize(m_brick_grid.x * m_brick_grid.y * m_brick_grid.z);
+    auto brick_at = [&](int x, int y, int z) -> Brick& {
+        return m_bricks[(z * m_brick_grid.y + y) * m_brick_grid.x + x];
+    };
+
+    // first pass for the opacity range of each brick, including its apron since it is sampled too
+    std::vector<Brick> row_ranges(m_brick_grid.x);
+    for (int z = 0; z < size.z; ++z) {
+        for (int y = 0; y < size.y; ++y) {
+            const void* data = row(y, z);
+            for (int bx = 0; bx < m_brick_grid.x; ++bx) {
+                auto& r = row_ranges[bx];
+                r = Brick{};
+                int end = std::min(size.x, (bx + 1) * brick_size + 1);
+                for (int x = std::max(0, bx * brick_size - 1); x < end; ++x) {
+                    auto o = opacity(data, x);
+                    r.min_opacity = std::min(r.min_opacity, o);
+                    r.max_opacity = std::max(r.max_opacity, o);
+                }
+            }
+            for (int bz = std::max(0, z - 1) / brick_size; bz <= std::min(size.z - 1, z + 1) / brick_size; ++bz) {
+                for (int by = std::max(0, y - 1) / brick_size; by <= std::min(size.y - 1, y + 1) / brick_size; ++by) {
+                    for (int bx = 0; bx < m_brick_grid.x; ++bx) {
+                        auto& b = brick_at(bx, by, bz);
+                        b.min_opacity = std::min(b.min_opacity, row_ranges[bx].min_opacity);
+                        b.max_opacity = std::max(b.max_opacity, row_ranges[bx].max_opacity);
+                    }
+                }
             }
         }
+        if (progress)
+            progress(0.5f * (z + 1) / size.z);
     }
-    glTexImage3D(GL_TEXTURE_3D, 0, format, size.x, size.y, size.z, 0, format, GL_UNSIGNED_BYTE, other_data);
-    delete[] other_data;
 
+    // lay out the visible bricks in a roughly cubic atlas
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_size);
+    const int max_slots = std::min(255, max_size / slot_size); // slots are stored as bytes in the page table
+    int visible = std::count_if(m_bricks.begin(), m_bricks.end(), [](const Brick& b) { return b.max_opacity > 0; });
+    glm::ivec3 slots;
+    slots.x = slots.y = std::min(max_slots, std::max(1, (int)std::ceil(std::cbrt((float)visible))));
+    slots.z = std::min(max_slots, std::max(1, (visible + slots.x * slots.y - 1) / (slots.x * slots.y)));
+    if (visible > slots.x * slots.y * slots.z)
+        Log::Error("Too many bricks for the atlas, some will be missing");
+    m_atlas_size = slots * slot_size;
+
+    std::vector<unsigned char> pages(m_bricks.size() * 4, 0);
+    int next_slot = 0;
+    for (size_t i = 0; i < m_bricks.size(); ++i) {
+        if (m_bricks[i].max_opacity == 0 or next_slot >= slots.x * slots.y * slots.z)
+            continue;
+        m_bricks[i].slot = next_slot++;
+        pages[4 * i + 0] = m_bricks[i].slot % slots.x;
+        pages[4 * i + 1] = (m_bricks[i].slot / slots.x) % slots.y;
+        pages[4 * i + 2] = m_bricks[i].slot / (slots.x * slots.y);
+        pages[4 * i + 3] = 1;
+    }
+
+    glGenTextures(1, &m_pages);
+    glBindTexture(GL_TEXTURE_3D, m_pages);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8UI, m_brick_grid.x, m_brick_grid.y, m_brick_grid.z, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, pages.data());
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &m_texture);
+    glBindTexture(GL_TEXTURE_3D, m_texture);
+    glTexImage3D(GL_TEXTURE_3D, 0, GlUtils::internalFormat(c, type), m_atlas_size.x, m_atlas_size.y, m_atlas_size.z, 0, GlUtils::format(c), type, nullptr);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-}
 
-Volume::Volume(glm::ivec3 size, int c) : Volume(nullptr, size, c) {}
+    // second pass to gather and upload the visible bricks, one row of bricks at a time
+    const size_t slot_bytes = (size_t)slot_size * slot_size * slot_size * voxel_bytes;
+    std::vector<unsigned char> staging(m_brick_grid.x * slot_bytes);
+    for (int bz = 0; bz < m_brick_grid.z; ++bz) {
+        for (int by = 0; by < m_brick_grid.y; ++by) {
+            bool any = false;
+            for (int bx = 0; bx < m_brick_grid.x; ++bx)
+                any = any or brick_at(bx, by, bz).slot >= 0;
+            if (!any)
+                continue;
+            // the apron is clamped to the volume's edges, like the dense texture
+            for (int lz = 0; lz < slot_size; ++lz) {
+                int z = glm::clamp(bz * brick_size - 1 + lz, 0, size.z - 1);
+                for (int ly = 0; ly < slot_size; ++ly) {
+                    int y = glm::clamp(by * brick_size - 1 + ly, 0, size.y - 1);
+                    auto data = static_cast<const unsigned char*>(row(y, z));
+                    for (int bx = 0; bx < m_brick_grid.x; ++bx) {
+                        if (brick_at(bx, by, bz).slot < 0)
+                            continue;
+                        auto dst = &staging[bx * slot_bytes + (lz * slot_size + ly) * slot_size * voxel_bytes];
+                        for (int lx = 0; lx < slot_size; ++lx) {
+                            int x = glm::clamp(bx * brick_size - 1 + lx, 0, size.x - 1);
+                            std::memcpy(dst + lx * voxel_bytes, data + x * voxel_bytes, voxel_bytes);
+                        }
+                    }
+                }
+            }
+            for (int bx = 0; bx < m_brick_grid.x; ++bx) {
+                int slot = brick_at(bx, by, bz).slot;
+                if (slot < 0)
+                    continue;
+                glm::ivec3 offset(slot % slots.x, (slot / slots.x) % slots.y, slot / (slots.x * slots.y));
+                offset *= slot_size;
+                glTexSubImage3D(GL_TEXTURE_3D, 0, offset.x, offset.y, offset.z, slot_size, slot_size, slot_size,
+                                GlUtils::format(c), type, &staging[bx * slot_bytes]);
+            }
+        }
+        if (progress)
+            progress(0.5f + 0.5f * (bz + 1) / m_brick_grid.z);
+    }
+
+    size_t dense_bytes = (size_t)size.x * size.y * size.z * voxel_bytes;
+    size_t atlas_bytes = (size_t)m_atlas_size.x * m_atlas_size.y * m_atlas_size.z * voxel_bytes;
+    Log::Info(FMT("{}/{} bricks uploaded, {}MB instead of {}MB"), next_slot, m_bricks.size(), atlas_bytes >> 20, dense_bytes >> 20);
+}
 
 Volume::~Volume() {
     glDeleteTextures(1, &m_texture);
+    if (m_pages)
+        glDeleteTextures(1, &m_pages);
 }
 
-namespace { namespace VolumeShader {
-    bool ok = false;
+void Volume::upload(const void* data, int z, int depth) {
+    if (bricked()) {
+        Log::Error("Bricked volumes can't be updated");
+        return;
+    }
+    glBindTexture(GL_TEXTURE_3D, m_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, z, m_size.x, m_size.y, depth, GlUtils::format(m_channels), m_type, data);
+    ++m_data_revision;
+}
+
+namespace { namespace Raymarch {
+    // shared by all the volume shaders, pos and ray_end are in texture coordinates
+    const char* source = R"GLSL(
+uniform sampler3D volume;
+uniform int channels;
+uniform vec3 volume_size; // in voxels
+uniform float samples_per_voxel;
+uniform float jitter; // in [0, 1), changes with each progressive sample, negative without jitter
+const float reference_step = 0.15; // in texture coordinates, the opacities are meant for that step length
 
-    GLuint program;
+#ifdef BRICKED
+// the volume sampler is the brick atlas, and pages holds the atlas slot of each brick (w is 0 for empty bricks)
+uniform mediump usampler3D pages;
+uniform vec3 atlas_size; // in voxels
+const float brick_size = 32.0;
+const float slot_size = 34.0; // the brick, and one voxel of apron on each side
 
+// if the brick of pos is empty, returns the number of steps needed to leave it
+// otherwise returns 0, and atlas_pos is where pos is stored in the atlas
+int brick_lookup(vec3 pos, vec3 delta, out vec3 atlas_pos)
+{
+    vec3 voxel = pos * volume_size;
+    vec3 brick = min(floor(voxel / brick_size), ceil(volume_size / brick_size) - 1.0);
+    uvec4 page = texelFetch(pages, ivec3(brick), 0);
+    if (page.w == 0u) {
+        // the bound ahead on each axis. along an axis the ray is parallel to, it is out of reach rather than
+        // a division by zero, which glsl leaves undefined
+        vec3 bound = (brick + step(0.0, delta)) * brick_size / volume_size;
+        vec3 t = abs(bound - pos) / max(abs(delta), vec3(1e-30));
+        float t_exit = min(min(t.x, t.y), min(t.z, 65536.0));
+        atlas_pos = vec3(0);
+        return int(floor(t_exit)) + 1;
+    }
+    atlas_pos = (vec3(page.xyz) * slot_size + 1.0 + voxel - brick * brick_size) / atlas_size;
+    return 0;
+}
+#endif
+
+vec4 raymarch(vec3 pos, vec3 ray_end)
+{
+    vec3 dir = ray_end - pos;
+    // the same number of samples per voxel crossed, whatever the direction and resolution
+    float samples = length(dir * volume_size) * samples_per_voxel;
+    vec3 step = dir / samples;
+    int steps = int(floor(samples));
+    // so that the accumulated opacity doesn't depend on the step length
+    float opacity_exponent = length(step) / reference_step;
+    if (jitter >= 0.0) {
+        // interleaved gradient noise, so that neighbouring pixels don't sample at the same depths
+        float noise = fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+        pos += fract(noise + jitter) * step;
+    }
+
+    vec4 dst = vec4(0.0);
+    for (int i = 0; i < steps; ++i) {
+#ifdef BRICKED
+        vec3 atlas_pos;
+        int skipped = brick_lookup(pos, step, atlas_pos);
+        if (skipped > 0) {
+            i += skipped - 1;
+            pos += float(skipped) * step;
+            continue;
+        }
+        vec4 val = texture(volume, atlas_pos);
+#else
+        vec4 val = texture(volume, pos);
+#endif
+        if (channels == 1) // intensity
+            val = vec4(val.r);
+        else if (channels == 2) // intensity and opacity
+            val = val.rrrg;
+        val.a = 1.0 - pow(1.0 - val.a, opacity_exponent);
+
+        val.rgb *= val.a;
+        dst += (1.0f - dst.a) * val;
+
+        if (dst.a > 0.95)
+            break;
+        pos += step;
+    }
+    return dst;
+}
+)GLSL";
+
+    // highp, as mediump's 11 bits drift over the hundreds of pos += step of a march and can't address the voxels
+    // of large volumes, nor the bricks of the atlas
+    std::string fragment(const char* main, bool bricked) {
+        std::string res = "#version 300 es\n";
+        if (bricked)
+            res += "#define BRICKED\n";
+        res += "precision highp float;\n";
+        res += "precision mediump sampler3D;\nprecision mediump usampler3D;\n";
+        return res + source + main;
+    }
+
+    struct Uniforms {
+        GLuint VolumeID;
+        GLuint ChannelsID;
+        GLuint PagesID;
+        GLuint VolumeSizeID;
+        GLuint SamplesPerVoxelID;
+        GLuint JitterID;
+        GLuint AtlasSizeID;
+    };
+
+    Uniforms locate(GLuint program) {
+        Uniforms u;
+        u.VolumeID = glGetUniformLocation(program, "volume");
+        u.ChannelsID = glGetUniformLocation(program, "channels");
+        u.PagesID = glGetUniformLocation(program, "pages");
+        u.VolumeSizeID = glGetUniformLocation(program, "volume_size");
+        u.SamplesPerVoxelID = glGetUniformLocation(program, "samples_per_voxel");
+        u.JitterID = glGetUniformLocation(program, "jitter");
+        u.AtlasSizeID = glGetUniformLocation(program, "atlas_size");
+        return u;
+    }
+
+    // binds the volume to the given texture unit, and its page table to the next one
+    void bind(const Uniforms& u, const Volume& volume, int unit, float samples_per_voxel, float jitter) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_3D, volume.texture());
+        glUniform1i(u.VolumeID, unit);
+        glUniform1i(u.ChannelsID, volume.channels());
+        const glm::vec3 volume_size(volume.size());
+        glUniform3fv(u.VolumeSizeID, 1, &volume_size[0]);
+        glUniform1f(u.SamplesPerVoxelID, samples_per_voxel);
+        glUniform1f(u.JitterID, jitter);
+        if (volume.bricked()) {
+            glActiveTexture(GL_TEXTURE0 + unit + 1);
+            glBindTexture(GL_TEXTURE_3D, volume.pages());
+            glUniform1i(u.PagesID, unit + 1);
+            const glm::vec3 atlas_size(volume.atlas_size());
+            glUniform3fv(u.AtlasSizeID, 1, &atlas_size[0]);
+        }
+    }
+}}
+
+namespace { namespace VolumeShader {
     const char* vert = R"VERT(#version 300 es
 precision mediump float;
 layout (location = 0) in vec3 Position;
@@ -68,87 +366,199 @@ void main()
     gl_Position = vec4(Position.xyz, 1);
 })VERT";
 
-    const char* frag = R"FRAG(#version 300 es
-precision mediump float;
-precision mediump sampler3D;
+    const char* frag = R"FRAG(
 layout (location = 0) out vec4 Out_Color;
 in vec2 uv;
 uniform sampler2D front;
 uniform sampler2D back;
-uniform sampler3D volume;
 void main()
 {
     vec4 tmp = texture(front, uv);
     if (tmp.a == 0.0)
         discard;
-    vec3 pos = tmp.xyz;
-    vec3 ray_end = texture(back, uv).xyz;
-    vec3 dir = ray_end - pos;
-    vec3 step = 0.15 * normalize(dir);
-    float max_length2 = dot(dir, dir);
-    float step_length2 = dot(step, step);
-    int steps = clamp(int(floor(sqrt(max_length2 / step_length2))), 0, 50);
+    Out_Color = raymarch(tmp.xyz, texture(back, uv).xyz);
+})FRAG";
 
-    vec4 dst = vec4(0.0);
-    for (int i = 0; i < steps; ++i) {
-        vec4 val = texture(volume, pos);
+    struct Program {
+        bool ok = false;
+        GLuint program;
+        GLuint FrontID;
+        GLuint BackID;
+        Raymarch::Uniforms raymarch;
+    };
+    Program programs[2]; // for dense and bricked volumes
 
-        val.rgb *= val.a;
-        dst += (1.0f - dst.a) * val;
+    Program& init(bool bricked) {
+        auto& p = programs[bricked];
+        if (p.ok)
+            return p;
+        if (!create_program(p.program, vert, Raymarch::fragment(frag, bricked).c_str()) or p.program == 0) {
+            Log::Error("Error creating program");
+            return p;
+        }
+        p.FrontID = glGetUniformLocation(p.program, "front");
+        p.BackID = glGetUniformLocation(p.program, "back");
+        p.raymarch = Raymarch::locate(p.program);
 
-        if (dst.a > 0.95)
-            break;
-        pos += step;
+        p.ok = true;
+        return p;
     }
-    Out_Color = dst;
+}}
+
+namespace { namespace RayBoxShader {
+    const char* vert = R"VERT(#version 300 es
+precision highp float;
+layout (location = 0) in vec3 Position;
+uniform mat4 mvp;
+uniform vec3 ratio;
+void main()
+{
+    gl_Position = mvp * vec4(ratio * Position.xyz, 1);
+})VERT";
+
+    // unprojects the fragment to get its ray, and clips it against the [-1, 1] cube
+    const char* frag = R"FRAG(
+layout (location = 0) out vec4 Out_Color;
+uniform mat4 mvp_inverse;
+uniform vec4 viewport;
+uniform vec3 ratio;
+void main()
+{
+    vec2 ndc = 2.0 * (gl_FragCoord.xy - viewport.xy) / viewport.zw - 1.0;
+    vec4 near = mvp_inverse * vec4(ndc, -1, 1);
+    vec4 far = mvp_inverse * vec4(ndc, 1, 1);
+    vec3 origin = near.xyz / (near.w * ratio);
+    vec3 dir = far.xyz / (far.w * ratio) - origin;
+
+    vec3 t0 = (vec3(-1) - origin) / dir;
+    vec3 t1 = (vec3(1) - origin) / dir;
+    vec3 tmin = min(t0, t1);
+    vec3 tmax = max(t0, t1);
+    float t_enter = max(max(tmin.x, tmin.y), max(tmin.z, 0.0));
+    float t_exit = min(min(tmax.x, tmax.y), tmax.z);
+    if (t_enter >= t_exit)
+        discard;
+
+    vec3 pos = 0.5 * (origin + t_enter * dir) + 0.5;
+    vec3 ray_end = 0.5 * (origin + t_exit * dir) + 0.5;
+    Out_Color = raymarch(pos, ray_end);
 })FRAG";
 
-    GLuint FrontID;
-    GLuint BackID;
-    GLuint VolumeID;
+    struct Program {
+        bool ok = false;
+        GLuint program;
+        GLuint MvpID;
+        GLuint MvpInverseID;
+        GLuint ViewportID;
+        GLuint RatioID;
+        Raymarch::Uniforms raymarch;
+    };
+    Program programs[2]; // for dense and bricked volumes
 
-    void init() {
-        if (ok)
-            return;
-        if (!create_program(program, vert, frag) or program == 0) {
+    Program& init(bool bricked) {
+        auto& p = programs[bricked];
+        if (p.ok)
+            return p;
+        if (!create_program(p.program, vert, Raymarch::fragment(frag, bricked).c_str()) or p.program == 0) {
             Log::Error("Error creating program");
-            return;
+            return p;
         }
-        FrontID = glGetUniformLocation(program, "front");
-        BackID = glGetUniformLocation(program, "back");
-        VolumeID = glGetUniformLocation(program, "volume");
+        p.MvpID = glGetUniformLocation(p.program, "mvp");
+        p.MvpInverseID = glGetUniformLocation(p.program, "mvp_inverse");
+        p.ViewportID = glGetUniformLocation(p.program, "viewport");
+        p.RatioID = glGetUniformLocation(p.program, "ratio");
+        p.raymarch = Raymarch::locate(p.program);
 
-        ok = true;
+        p.ok = true;
+        return p;
     }
 }}
 
+Volume::PerCamera& Volume::perCamera(const Camera& cam) const {
+    const unsigned long frame = Engine::frame();
+    for (auto it = m_cameras.begin(); it != m_cameras.end();)
+        it = it->second.used + unused_frames < frame ? m_cameras.erase(it) : std::next(it);
+    auto& res = m_cameras[cam.id()];
+    res.used = frame;
+    return res;
+}
+
+float Volume::samplesPerVoxel(const Camera& cam) const {
+    auto& last_revision = perCamera(cam).last_revision;
+    bool moving = last_revision != cam.revision();
+    last_revision = cam.revision();
+    if (moving and m_interactive)
+        return m_quality * interactive_factor;
+    return m_quality;
+}
+
+int Volume::progressive() const {
+    return m_accumulator ? m_accumulator->samples() : 0;
+}
+
+void Volume::set_progressive(int samples) {
+    if (samples <= 0)
+        m_accumulator.reset();
+    else if (m_accumulator)
+        m_accumulator->set_samples(samples);
+    else
+        m_accumulator.reset(new Accumulator(samples));
+}
+
 void Volume::render(const Camera& cam) const {
-    using namespace VolumeShader;
-    VolumeShader::init();
+    PROFILE_SCOPE("volume");
+    // also drops what was kept for the cameras that stopped rendering, even when nothing is drawn
+    perCamera(cam);
+    if (!m_accumulator) {
+        draw(cam, cam.projection_view(), cam.viewport(), -1.f);
+        return;
+    }
+    size_t content = std::hash<float>()(m_quality) ^ (m_render_mode << 1) ^ (m_data_revision << 2);
+    m_accumulator->render(cam, content, [&](const Accumulator::Sample& s) {
+        draw(cam, s.projection_view, s.viewport, s.offset);
+    });
+}
+
+void Volume::draw(const Camera& cam, const glm::mat4& mvp, const Viewport& v, float jitter) const {
+    switch (m_render_mode) {
+        // the entry and exit points are cached for the camera's view, so no subpixel jitter there
+        case EntryExitTextures: renderEntryExit(cam, jitter); break;
+        case RayBox: renderRayBox(cam, mvp, v, jitter); break;
+    }
+}
 
+void Volume::renderEntryExit(const Camera& cam, float jitter) const {
+    auto& shader = VolumeShader::init(bricked());
 
-    Cube cube;
-    // TODO cache the textures if the viewport hasn't changed?
     const auto& v = cam.viewport();
-    TexturedQuad front(v.width, v.height, 4);
-    cube.renderToTexture(cam, m_ratio, true, front);
-    TexturedQuad back(v.width, v.height, 4);
-    cube.renderToTexture(cam, m_ratio, false, back);
+    auto& targets = perCamera(cam).targets;
+    if (!targets.front or targets.front->width() != v.width or targets.front->height() != v.height) {
+        targets.front.reset(new TexturedQuad(v.width, v.height, 4));
+        targets.back.reset(new TexturedQuad(v.width, v.height, 4));
+        targets.revision = 0;
+    }
+    // the entry and exit points only depend on the view, no need to redraw them if it hasn't changed
+    if (targets.revision != cam.revision()) {
+        PROFILE_SCOPE("entry/exit points");
+        Cube cube;
+        cube.renderToTexture(cam, m_ratio, true, *targets.front);
+        cube.renderToTexture(cam, m_ratio, false, *targets.back);
+        targets.revision = cam.revision();
+    }
 
+    PROFILE_SCOPE("raymarch");
     //glViewport(v.x, v.y, v.width, v.height);
-    glUseProgram(program);
+    glUseProgram(shader.program);
 
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, front.texture());
-    glUniform1i(FrontID, 0);
+    glBindTexture(GL_TEXTURE_2D, targets.front->texture());
+    glUniform1i(shader.FrontID, 0);
 
     glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, back.texture());
-    glUniform1i(BackID, 1);
+    glBindTexture(GL_TEXTURE_2D, targets.back->texture());
+    glUniform1i(shader.BackID, 1);
 
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_3D, m_texture);
-    glUniform1i(VolumeID, 2);
+    Raymarch::bind(shader.raymarch, *this, 2, samplesPerVoxel(cam), jitter);
 
     glEnableVertexAttribArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, TexturedQuad::verticesBuffer());
@@ -156,3 +566,29 @@ void Volume::render(const Camera& cam) const {
 
     glDrawArrays(GL_TRIANGLES, 0, 6);
 }
+
+void Volume::renderRayBox(const Camera& cam, const glm::mat4& mvp, const Viewport& v, float jitter) const {
+    PROFILE_SCOPE("raymarch");
+    auto& shader = RayBoxShader::init(bricked());
+
+    const auto mvp_inverse = glm::inverse(mvp);
+    const glm::vec4 viewport(v.x, v.y, v.width, v.height);
+
+    glUseProgram(shader.program);
+    glUniformMatrix4fv(shader.MvpID, 1, GL_FALSE, &mvp[0][0]);
+    glUniformMatrix4fv(shader.MvpInverseID, 1, GL_FALSE, &mvp_inverse[0][0]);
+    glUniform4fv(shader.ViewportID, 1, &viewport[0]);
+    glUniform3fv(shader.RatioID, 1, &m_ratio[0]);
+
+    Raymarch::bind(shader.raymarch, *this, 0, samplesPerVoxel(cam), jitter);
+
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, Cube::verticesBuffer());
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+    // back faces so that each pixel is shaded once, even with the camera inside the volume
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+    glDrawArrays(GL_TRIANGLES, 0, Cube::verticesCount());
+    glDisable(GL_CULL_FACE);
+}
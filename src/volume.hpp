@@ -2,28 +2,114 @@
 
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <optional>
+#include <unordered_map>
 #include <vector>
 
 #include <GLES3/gl3.h>
 #include "camera.hpp"
+#include "textured_quad.hpp"
+
+class Accumulator;
 
 class Volume {
 public:
-    Volume(const unsigned char* data, glm::ivec3 size, int c);
+    enum RenderMode {
+        EntryExitTextures, // rasterize the ray entry and exit points, then march in a full-screen pass
+        RayBox,            // draw the cube once and intersect the rays with it in the fragment shader
+    };
+
+    // type is GL_UNSIGNED_BYTE or GL_HALF_FLOAT, data may be null and uploaded later
+    Volume(const void* data, glm::ivec3 size, int c,
+           GLenum type = GL_UNSIGNED_BYTE,
+           glm::vec3 spacing = glm::vec3(1.f));
+    // test volume, with a gradient along each channel
     Volume(glm::ivec3 size, int c);
+    static std::vector<unsigned char> gradient(glm::ivec3 size, int c);
+
+    // returns the row of voxels at (y, z), valid until the next call
+    using RowSource = std::function<const void*(int y, int z)>;
+    using Progress = std::function<void(float)>;
+    // bricked storage, only the bricks with visible voxels are uploaded to an atlas and the others are skipped when rendering
+    Volume(glm::ivec3 size, int c, GLenum type, glm::vec3 spacing,
+           const RowSource& row,
+           const Progress& progress = {});
     ~Volume();
 
+    // uploads the slices [z, z + depth), in the volume's format
+    void upload(const void* data, int z, int depth);
+
     void render(const Camera& cam) const;
 
     const glm::ivec3& size() const { return m_size; }
     int channels() const { return m_channels; }
+    GLenum type() const { return m_type; }
     const glm::vec3& ratio() const { return m_ratio; }
-    GLuint texture() const { return m_texture; }
+    GLuint texture() const { return m_texture; } // the brick atlas if bricked
+
+    bool bricked() const { return m_pages != 0; }
+    GLuint pages() const { return m_pages; }
+    const glm::ivec3& atlas_size() const { return m_atlas_size; }
+
+    RenderMode render_mode() const { return m_render_mode; }
+    void set_render_mode(RenderMode m) { m_render_mode = m; }
+
+    // samples taken per voxel crossed by a ray
+    float quality() const { return m_quality; }
+    void set_quality(float q) { m_quality = q; }
+
+    // lowers the quality while the camera moves
+    bool interactive() const { return m_interactive; }
+    void set_interactive(bool i) { m_interactive = i; }
+    static constexpr float interactive_factor = 0.25f;
+
+    // number of jittered frames averaged while the view doesn't change, 0 to render every frame from scratch
+    int progressive() const;
+    void set_progressive(int samples);
 
 private:
+    // jitter in [0, 1) offsets the start of the rays, negative to disable it
+    void draw(const Camera& cam, const glm::mat4& mvp, const Viewport& v, float jitter) const;
+    void renderEntryExit(const Camera& cam, float jitter) const;
+    void renderRayBox(const Camera& cam, const glm::mat4& mvp, const Viewport& v, float jitter) const;
+    float samplesPerVoxel(const Camera& cam) const;
+
     glm::ivec3 m_size; // (height, width, depth)-tuple
     int m_channels;
+    GLenum m_type;
     glm::vec3 m_ratio; // ratio along the x, y and z axes
     GLuint m_texture;
+    RenderMode m_render_mode = EntryExitTextures;
+    float m_quality = 1.f;
+    bool m_interactive = true;
+    std::unique_ptr<Accumulator> m_accumulator;
+    unsigned long m_data_revision = 0; // for the accumulation to restart after an upload
+
+    struct Brick {
+        // in the volume's format, raw bits for half floats
+        uint16_t min_opacity = 0xffff;
+        uint16_t max_opacity = 0;
+        int slot = -1; // in the atlas, -1 if not uploaded
+    };
+    std::vector<Brick> m_bricks;
+    glm::ivec3 m_brick_grid = glm::ivec3(0);
+    glm::ivec3 m_atlas_size = glm::ivec3(0);
+    GLuint m_pages = 0; // atlas slot of each brick
+
+    // kept per camera id, and dropped once the camera hasn't rendered the volume for a while
+    struct RayTargets {
+        unsigned long revision = 0;
+        std::unique_ptr<TexturedQuad> front;
+        std::unique_ptr<TexturedQuad> back;
+    };
+    struct PerCamera {
+        unsigned long used = 0;          // frame
+        unsigned long last_revision = 0; // to know if it moved
+        RayTargets targets;              // ray entry/exit points
+    };
+    mutable std::unordered_map<unsigned long, PerCamera> m_cameras;
+    PerCamera& perCamera(const Camera& cam) const;
 };
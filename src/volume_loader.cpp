@@ -0,0 +1,458 @@
+#include "volume_loader.hpp"
+#include "volume.hpp"
+#include "utils.hpp"
+#include "log.hpp"
+#include "glUtils.hpp"
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace VolumeLoader {
+
+namespace {
+    // upper bound on the data converted and uploaded at once, this is also the peak memory used on top of the mapping
+    const size_t chunk_size = 16 << 20;
+
+    struct MappedFile {
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile() { if (data) munmap((void*)data, size); }
+
+        bool open(const std::string& path) {
+            auto fd = ::open(path.c_str(), O_RDONLY);
+            if (fd == -1)
+                return false;
+            auto close_fd = on_scope_end([&]() { close(fd); });
+            struct stat st;
+            if (fstat(fd, &st) != 0 or S_ISDIR(st.st_mode) or st.st_size == 0)
+                return false;
+            auto mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mem == MAP_FAILED)
+                return false;
+            data = (const unsigned char*)mem;
+            size = st.st_size;
+            madvise(mem, size, MADV_SEQUENTIAL);
+            return true;
+        }
+
+        // gives the pages back to the kernel once they have been uploaded
+        void release(size_t begin, size_t end) const {
+            static const size_t page = sysconf(_SC_PAGESIZE);
+            begin &= ~(page - 1);
+            end &= ~(page - 1);
+            if (end > begin)
+                madvise((void*)(data + begin), end - begin, MADV_DONTNEED);
+        }
+
+        const char* chars() const { return (const char*)data; }
+
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+    };
+
+    std::string trim(const std::string& s) {
+        auto begin = std::find_if_not(s.begin(), s.end(), [](unsigned char c) { return std::isspace(c); });
+        auto end = std::find_if_not(s.rbegin(), s.rend(), [](unsigned char c) { return std::isspace(c); }).base();
+        return begin < end ? std::string(begin, end) : std::string();
+    }
+
+    std::string lower(std::string s) {
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+        return s;
+    }
+
+    template<typename T>
+    std::vector<T> split(const std::string& s) {
+        std::vector<T> res;
+        std::istringstream stream(s);
+        T val;
+        while (stream >> val)
+            res.push_back(val);
+        return res;
+    }
+
+    // calls func(line, key, value) for each line until it returns false, returns the offset after the last line read
+    template<typename Func>
+    size_t forEachLine(const char* data, size_t size, char separator, Func func) {
+        size_t pos = 0;
+        while (pos < size) {
+            auto end = (const char*)std::memchr(data + pos, '\n', size - pos);
+            size_t line_end = end ? end - data : size;
+            std::string line(data + pos, data + line_end);
+            pos = std::min(line_end + 1, size);
+            if (!line.empty() and line.back() == '\r')
+                line.pop_back();
+
+            std::string key, value;
+            auto sep = line.find(separator);
+            if (sep != std::string::npos) {
+                key = trim(line.substr(0, sep));
+                value = trim(line.substr(sep + 1));
+            } else {
+                key = trim(line);
+            }
+            if (!func(line, key, value))
+                break;
+        }
+        return pos;
+    }
+
+    bool parseType(const std::string& type, Header& out) {
+        static const std::vector<const char*> uint8 = { "uchar", "unsigned char", "uint8", "uint8_t", "met_uchar" };
+        static const std::vector<const char*> int8 = { "signed char", "int8", "int8_t", "met_char" };
+        static const std::vector<const char*> uint16 = { "ushort", "unsigned short", "unsigned short int", "uint16", "uint16_t", "met_ushort" };
+        static const std::vector<const char*> int16 = { "short", "short int", "signed short", "signed short int", "int16", "int16_t", "met_short" };
+        auto is_in = [t = lower(type)](const std::vector<const char*>& names) {
+            return std::find(names.begin(), names.end(), t) != names.end();
+        };
+        if (is_in(uint8) or is_in(int8)) {
+            out.bytes_per_channel = 1;
+            out.is_signed = is_in(int8);
+        } else if (is_in(uint16) or is_in(int16)) {
+            out.bytes_per_channel = 2;
+            out.is_signed = is_in(int16);
+        } else {
+            Log::Error(FMT("Unsupported voxel type: {}"), type);
+            return false;
+        }
+        return true;
+    }
+
+    // the sizes may have a leading channel axis
+    bool parseSizes(const std::vector<int>& sizes, int channels, Header& out) {
+        if (sizes.size() == 4) {
+            channels = sizes[0];
+        } else if (sizes.size() != 3) {
+            Log::Error("Only 3d volumes are supported");
+            return false;
+        }
+        if (channels < 1 or channels > 4) {
+            Log::Error("Invalid channels number");
+            return false;
+        }
+        auto n = sizes.size();
+        out.size = { sizes[n - 3], sizes[n - 2], sizes[n - 1] };
+        out.channels = channels;
+        return out.size.x > 0 and out.size.y > 0 and out.size.z > 0;
+    }
+
+    bool parseNrrd(const char* data, size_t size, Header& out) {
+        bool ok = true;
+        bool first = true;
+        std::vector<int> sizes;
+        std::vector<float> spacings;
+        long byte_skip = 0;
+        auto header_end = forEachLine(data, size, ':', [&](const std::string& line, const std::string& key, std::string value) {
+            if (first) { // magic
+                first = false;
+                return true;
+            }
+            if (line.empty()) // end of the header
+                return false;
+            if (line[0] == '#' or (!value.empty() and value[0] == '=')) // comment or key/value pair
+                return true;
+
+            auto k = lower(key);
+            if (k == "type") {
+                ok = ok and parseType(value, out);
+            } else if (k == "sizes") {
+                sizes = split<int>(value);
+            } else if (k == "endian") {
+                out.big_endian = (lower(value) == "big");
+            } else if (k == "encoding") {
+                if (lower(value) != "raw") {
+                    Log::Error(FMT("Unsupported NRRD encoding: {}"), value);
+                    ok = false;
+                }
+            } else if (k == "data file" or k == "datafile") {
+                out.data_file = value;
+            } else if (k == "byte skip" or k == "byteskip") {
+                byte_skip = std::atol(value.c_str());
+            } else if (k == "spacings") {
+                spacings = split<float>(value);
+            } else if (k == "space directions") {
+                // spacing is the norm of each axis direction, "none" for the channel axis
+                spacings.clear();
+                for (auto open = value.find('('); open != std::string::npos; open = value.find('(', open + 1)) {
+                    auto close = value.find(')', open);
+                    if (close == std::string::npos)
+                        break;
+                    auto dir = value.substr(open + 1, close - open - 1);
+                    std::replace(dir.begin(), dir.end(), ',', ' ');
+                    auto v = split<float>(dir);
+                    if (v.size() == 3)
+                        spacings.push_back(std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]));
+                }
+            }
+            return true;
+        });
+        if (!ok or !parseSizes(sizes, 1, out))
+            return false;
+
+        spacings.erase(std::remove_if(spacings.begin(), spacings.end(), [](float f) { return !(f > 0.f); }), spacings.end());
+        if (spacings.size() >= 3)
+            out.spacing = { spacings[spacings.size() - 3], spacings[spacings.size() - 2], spacings.back() };
+
+        if (byte_skip < 0)
+            out.data_offset = -1;
+        else
+            out.data_offset = (out.data_file.empty() ? header_end : 0) + byte_skip;
+        return true;
+    }
+
+    bool parseMhd(const char* data, size_t size, Header& out) {
+        bool ok = true;
+        bool local = false;
+        int channels = 1;
+        std::vector<int> sizes;
+        auto header_end = forEachLine(data, size, '=', [&](const std::string&, const std::string& key, const std::string& value) {
+            if (key == "NDims") {
+                if (value != "3") {
+                    Log::Error("Only 3d volumes are supported");
+                    ok = false;
+                }
+            } else if (key == "DimSize") {
+                sizes = split<int>(value);
+            } else if (key == "ElementType") {
+                ok = ok and parseType(value, out);
+            } else if (key == "ElementNumberOfChannels") {
+                channels = std::atoi(value.c_str());
+            } else if (key == "ElementSpacing") {
+                auto s = split<float>(value);
+                if (s.size() == 3 and s[0] > 0.f and s[1] > 0.f and s[2] > 0.f)
+                    out.spacing = { s[0], s[1], s[2] };
+            } else if (key == "BinaryDataByteOrderMSB" or key == "ElementByteOrderMSB") {
+                out.big_endian = (lower(value) == "true");
+            } else if (key == "CompressedData") {
+                if (lower(value) == "true") {
+                    Log::Error("Compressed MetaImage data is not supported");
+                    ok = false;
+                }
+            } else if (key == "HeaderSize") {
+                out.data_offset = std::atol(value.c_str());
+            } else if (key == "ElementDataFile") { // always the last field
+                if (value == "LOCAL")
+                    local = true;
+                else
+                    out.data_file = value;
+                return false;
+            }
+            return true;
+        });
+        if (!ok or !parseSizes(sizes, channels, out))
+            return false;
+        if (local)
+            out.data_offset = header_end;
+        return true;
+    }
+
+    // signed values are offset so that the lowest value maps to 0
+    void convert(const Header& h, const unsigned char* src, size_t bytes, uint16_t* dst) {
+        if (h.bytes_per_channel == 1) {
+            auto out = reinterpret_cast<unsigned char*>(dst);
+            for (size_t i = 0; i < bytes; ++i)
+                out[i] = src[i] ^ 0x80;
+            return;
+        }
+        for (size_t i = 0; i < bytes / 2; ++i) {
+            uint16_t v = h.big_endian ? (src[2 * i] << 8) | src[2 * i + 1]
+                                      : src[2 * i] | (src[2 * i + 1] << 8);
+            if (h.is_signed)
+                v ^= 0x8000;
+            dst[i] = GlUtils::toHalf(v / 65535.f);
+        }
+    }
+
+    // where the voxels start in the file, false if it is too short for them
+    bool dataOffset(const Header& h, const MappedFile& file, size_t& offset) {
+        size_t needed = (size_t)h.size.x * h.size.y * h.size.z * h.channels * h.bytes_per_channel;
+        offset = h.data_offset < 0 ? file.size - std::min(needed, file.size) : (size_t)h.data_offset;
+        if (offset > file.size or file.size - offset < needed) {
+            Log::Error("Volume file is truncated");
+            return false;
+        }
+        return true;
+    }
+
+    // 16 bits data is stored as half floats, the only filterable 16 bits format of webgl2
+    GLenum voxelType(const Header& h) {
+        return h.bytes_per_channel == 2 ? GL_HALF_FLOAT : GL_UNSIGNED_BYTE;
+    }
+
+    std::unique_ptr<Volume> upload(const Header& h, const MappedFile& file, const Progress& progress, bool bricked) {
+        size_t slice_bytes = (size_t)h.size.x * h.size.y * h.channels * h.bytes_per_channel;
+        size_t offset;
+        if (!dataOffset(h, file, offset))
+            return nullptr;
+
+        bool as_is = h.bytes_per_channel == 1 and not h.is_signed;
+        GLenum type = voxelType(h);
+
+        if (bricked) {
+            // bricks are gathered from rows of the mapping, so only one row needs converting at a time
+            size_t row_bytes = (size_t)h.size.x * h.channels * h.bytes_per_channel;
+            std::vector<uint16_t> converted_row;
+            if (not as_is)
+                converted_row.resize((row_bytes + 1) / 2);
+            auto row = [&](int y, int z) -> const void* {
+                auto src = file.data + offset + ((size_t)z * h.size.y + y) * row_bytes;
+                if (as_is)
+                    return src;
+                convert(h, src, row_bytes, converted_row.data());
+                return converted_row.data();
+            };
+            return std::unique_ptr<Volume>(new Volume(h.size, h.channels, type, h.spacing, row, progress));
+        }
+
+        GLint max_size = 0;
+        glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_size);
+        if (h.size.x > max_size or h.size.y > max_size or h.size.z > max_size) {
+            Log::Error(FMT("Volume is too large, the maximum size is {}"), max_size);
+            return nullptr;
+        }
+        std::unique_ptr<Volume> volume(new Volume(nullptr, h.size, h.channels, type, h.spacing));
+
+        int slab = std::max<int>(1, chunk_size / slice_bytes);
+        std::vector<uint16_t> converted;
+        if (not as_is)
+            converted.resize((std::min<size_t>(slab, h.size.z) * slice_bytes + 1) / 2);
+
+        for (int z = 0; z < h.size.z; z += slab) {
+            int depth = std::min(slab, h.size.z - z);
+            size_t begin = offset + z * slice_bytes;
+            size_t bytes = depth * slice_bytes;
+            if (as_is) {
+                volume->upload(file.data + begin, z, depth);
+            } else {
+                convert(h, file.data + begin, bytes, converted.data());
+                volume->upload(converted.data(), z, depth);
+            }
+            file.release(begin, begin + bytes);
+            if (progress)
+                progress((float)(z + depth) / h.size.z);
+        }
+        return volume;
+    }
+}
+
+bool isVolumeHeader(const char* data, size_t size) {
+    auto starts_with = [&](const char* magic) {
+        auto n = std::strlen(magic);
+        return size >= n and std::memcmp(data, magic, n) == 0;
+    };
+    return starts_with("NRRD") or starts_with("ObjectType") or starts_with("NDims");
+}
+
+bool parseHeader(const char* data, size_t size, Header& out) {
+    if (size >= 4 and std::memcmp(data, "NRRD", 4) == 0)
+        return parseNrrd(data, size, out);
+    return parseMhd(data, size, out);
+}
+
+bool guessRawHeader(const std::string& path, Header& out) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    auto name = path.substr(path.find_last_of('/') + 1);
+    for (size_t i = 0; i < name.size(); ++i) {
+        if (!std::isdigit((unsigned char)name[i]) or (i > 0 and std::isdigit((unsigned char)name[i - 1])))
+            continue;
+        int x, y, z;
+        if (std::sscanf(name.c_str() + i, "%dx%dx%d", &x, &y, &z) != 3 or x <= 0 or y <= 0 or z <= 0)
+            continue;
+        size_t voxels = (size_t)x * y * z;
+        if (st.st_size % voxels != 0)
+            break;
+        out = Header{};
+        out.size = { x, y, z };
+        switch (st.st_size / voxels) {
+            case 1: break;
+            case 2: out.bytes_per_channel = 2; break;
+            case 3: out.channels = 3; break;
+            case 4: out.channels = 4; break;
+            default: return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+namespace {
+    // the header of the volume at path, from the file or its name, and the file its voxels are in
+    bool open(const std::string& path, Header& header, MappedFile& data) {
+        std::string data_path = path;
+        {
+            MappedFile file;
+            if (!file.open(path)) {
+                Log::Error(FMT("Can't open {}"), path);
+                return false;
+            }
+            if (!isVolumeHeader(file.chars(), file.size)) {
+                if (!guessRawHeader(path, header)) {
+                    Log::Error(FMT("Unknown volume format: {}"), path);
+                    return false;
+                }
+            } else if (!parseHeader(file.chars(), file.size, header)) {
+                return false;
+            }
+        }
+        if (!header.data_file.empty()) {
+            data_path = header.data_file;
+            auto dir = path.find_last_of('/');
+            if (data_path[0] != '/' and dir != std::string::npos)
+                data_path = path.substr(0, dir + 1) + data_path;
+        }
+        if (!data.open(data_path)) {
+            Log::Error(FMT("Can't open {}"), data_path);
+            return false;
+        }
+        return true;
+    }
+}
+
+std::unique_ptr<Volume> load(const std::string& path, const Progress& progress, bool bricked) {
+    Header header;
+    MappedFile data;
+    if (!open(path, header, data))
+        return nullptr;
+    return upload(header, data, progress, bricked);
+}
+
+std::unique_ptr<Volume> loadRaw(const std::string& path, const Header& header, const Progress& progress, bool bricked) {
+    MappedFile file;
+    if (!file.open(path)) {
+        Log::Error(FMT("Can't open {}"), path);
+        return nullptr;
+    }
+    return upload(header, file, progress, bricked);
+}
+
+bool read(const std::string& path, Header& header, GLenum& type, std::vector<unsigned char>& voxels) {
+    MappedFile data;
+    size_t offset;
+    if (!open(path, header, data) or !dataOffset(header, data, offset))
+        return false;
+    type = voxelType(header);
+    // half floats take as many bytes as the 16 bits values they come from
+    voxels.resize((size_t)header.size.x * header.size.y * header.size.z * header.channels * header.bytes_per_channel);
+    if (header.bytes_per_channel == 1 and not header.is_signed)
+        std::memcpy(voxels.data(), data.data + offset, voxels.size());
+    else
+        convert(header, data.data + offset, voxels.size(), (uint16_t*)voxels.data());
+    return true;
+}
+
+}
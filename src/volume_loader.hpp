@@ -0,0 +1,42 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <GLES3/gl3.h>
+
+class Volume;
+
+namespace VolumeLoader {
+    struct Header {
+        glm::ivec3 size = glm::ivec3(0); // in voxels, along x, y and z
+        int channels = 1;
+        int bytes_per_channel = 1;       // 1 or 2
+        bool is_signed = false;
+        bool big_endian = false;
+        glm::vec3 spacing = glm::vec3(1.f);
+        std::string data_file;           // relative to the header, empty if the data follows the header
+        long data_offset = 0;            // in the data file, negative means the data ends the file
+    };
+
+    // called after each uploaded slab, with the fraction of the volume loaded so far
+    using Progress = std::function<void(float)>;
+
+    // NRRD (raw encoding only) and MetaImage (.mhd/.mha)
+    bool isVolumeHeader(const char* data, size_t size);
+    bool parseHeader(const char* data, size_t size, Header& out);
+
+    // size from a name such as "scan_512x512x300.raw", bytes per voxel from the file size
+    bool guessRawHeader(const std::string& path, Header& out);
+
+    // bricked volumes only upload the bricks with visible voxels, see Volume
+    std::unique_ptr<Volume> load(const std::string& path, const Progress& progress = {}, bool bricked = false);
+    std::unique_ptr<Volume> loadRaw(const std::string& path, const Header& header, const Progress& progress = {}, bool bricked = false);
+
+    // the voxels in memory rather than uploaded, in the type load() gives Volume: GL_UNSIGNED_BYTE, or GL_HALF_FLOAT
+    // for 16 bits data. for the cpu renderer, which needs no gl
+    bool read(const std::string& path, Header& header, GLenum& type, std::vector<unsigned char>& voxels);
+}